@@ -0,0 +1,196 @@
+#pragma once
+
+#include <string>
+#include <cstring>
+#include <cstdint>
+
+// This class is a small LZ77-style block compressor shared by the client and the server.
+// It is used for large messages such as catalog listings and snapshots, which repeat a lot of text (authors, book types and the online book URL prefix).
+//
+// The input is split into 64 KB blocks which are compressed separately, so a match offset always fits in 2 bytes.
+// Each block is written as its raw length and compressed length (4 bytes each, little endian) followed by the block data.
+// If a block doesn't get smaller it is stored as it is, marked by the compressed length being equal to the raw length.
+//
+// Inside a block the data is a list of sequences. Each sequence is a token byte (high 4 bits: literal count, low 4 bits: match length - 4),
+// extra length bytes when a count is 15 or more, the literal bytes, then a 2 byte match offset. The last sequence in a block only has literals.
+class BlockCompressor {
+private:
+	static const size_t blockSize = 65536;
+	static const int hashBits = 14;
+	static const size_t minMatch = 4;
+
+	static uint32_t read32(const unsigned char* p) {
+		uint32_t value;
+		memcpy(&value, p, sizeof(value));
+		return value;
+	}
+
+	static void write32(std::string& out, uint32_t value) {
+		for (int i = 0; i < 4; i++) {
+			out.push_back((char)((value >> (8 * i)) & 0xFF));
+		}
+	}
+
+	// Writes the part of a length that doesn't fit in the token, as a run of 255s and a final byte.
+	static void writeLength(std::string& out, size_t length) {
+		while (length >= 255) {
+			out.push_back((char)255);
+			length -= 255;
+		}
+		out.push_back((char)length);
+	}
+
+	static bool readLength(const unsigned char*& p, const unsigned char* end, size_t& length) {
+		unsigned char byte;
+		do {
+			if (p >= end) {
+				return false;
+			}
+			byte = *p++;
+			length += byte;
+		} while (byte == 255);
+		return true;
+	}
+
+	static void writeSequence(std::string& out, const unsigned char* literals, size_t literalCount, size_t offset, size_t matchLength) {
+		size_t matchCode = matchLength ? matchLength - minMatch : 0;
+		unsigned char token = (unsigned char)(((literalCount < 15 ? literalCount : 15) << 4) | (matchCode < 15 ? matchCode : 15));
+		out.push_back((char)token);
+		if (literalCount >= 15) {
+			writeLength(out, literalCount - 15);
+		}
+		out.append((const char*)literals, literalCount);
+		if (matchLength) {
+			out.push_back((char)(offset & 0xFF));
+			out.push_back((char)(offset >> 8));
+			if (matchCode >= 15) {
+				writeLength(out, matchCode - 15);
+			}
+		}
+	}
+
+	// Compresses one block. Positions of 4 byte sequences are kept in a hash table so repeats can be found in a single pass.
+	static void compressBlock(const unsigned char* src, size_t length, std::string& out) {
+		uint32_t table[1 << hashBits];
+		memset(table, 0xFF, sizeof(table));
+		size_t pos = 0, anchor = 0;
+
+		while (length >= minMatch && pos + minMatch <= length) {
+			uint32_t sequence = read32(src + pos);
+			uint32_t hash = (sequence * 2654435761u) >> (32 - hashBits);
+			uint32_t candidate = table[hash];
+			table[hash] = (uint32_t)pos;
+
+			if (candidate != 0xFFFFFFFF && read32(src + candidate) == sequence) {
+				size_t matchLength = minMatch;
+				while (pos + matchLength < length && src[candidate + matchLength] == src[pos + matchLength]) {
+					matchLength++;
+				}
+				writeSequence(out, src + anchor, pos - anchor, pos - candidate, matchLength);
+				pos += matchLength;
+				anchor = pos;
+			}
+			else {
+				// Skip ahead faster through data that isn't compressing.
+				pos += 1 + ((pos - anchor) >> 6);
+			}
+		}
+		writeSequence(out, src + anchor, length - anchor, 0, 0);
+	}
+
+	static bool decompressBlock(const unsigned char* p, const unsigned char* end, unsigned char* dst, size_t rawLength) {
+		size_t written = 0;
+		while (p < end) {
+			unsigned char token = *p++;
+			size_t literalCount = token >> 4;
+			if (literalCount == 15 && !readLength(p, end, literalCount)) {
+				return false;
+			}
+			if (literalCount > (size_t)(end - p) || written + literalCount > rawLength) {
+				return false;
+			}
+			memcpy(dst + written, p, literalCount);
+			p += literalCount;
+			written += literalCount;
+			if (p == end) {
+				break; // The last sequence only has literals.
+			}
+
+			if (end - p < 2) {
+				return false;
+			}
+			size_t offset = p[0] | (p[1] << 8);
+			p += 2;
+			size_t matchLength = token & 15;
+			if (matchLength == 15 && !readLength(p, end, matchLength)) {
+				return false;
+			}
+			matchLength += minMatch;
+			if (offset == 0 || offset > written || written + matchLength > rawLength) {
+				return false;
+			}
+			if (offset >= matchLength) {
+				memcpy(dst + written, dst + written - offset, matchLength);
+			}
+			else {
+				// Copied a byte at a time because the match overlaps the bytes being written.
+				for (size_t i = 0; i < matchLength; i++) {
+					dst[written + i] = dst[written - offset + i];
+				}
+			}
+			written += matchLength;
+		}
+		return written == rawLength;
+	}
+
+public:
+	static std::string compress(const std::string& input) {
+		std::string out;
+		out.reserve(input.size() / 2 + 16);
+		const unsigned char* src = (const unsigned char*)input.data();
+		for (size_t start = 0; start < input.size(); start += blockSize) {
+			size_t length = input.size() - start < blockSize ? input.size() - start : blockSize;
+			std::string block;
+			compressBlock(src + start, length, block);
+			write32(out, (uint32_t)length);
+			if (block.size() >= length) {
+				write32(out, (uint32_t)length);
+				out.append(input, start, length);
+			}
+			else {
+				write32(out, (uint32_t)block.size());
+				out += block;
+			}
+		}
+		return out;
+	}
+
+	// Returns false if the input is not valid compressed data.
+	static bool decompress(const std::string& input, std::string& output) {
+		output.clear();
+		const unsigned char* p = (const unsigned char*)input.data();
+		const unsigned char* end = p + input.size();
+		while (p < end) {
+			if (end - p < 8) {
+				return false;
+			}
+			uint32_t rawLength = read32(p);
+			uint32_t compressedLength = read32(p + 4);
+			p += 8;
+			if (rawLength > blockSize || compressedLength > (size_t)(end - p)) {
+				return false;
+			}
+			size_t start = output.size();
+			output.resize(start + rawLength);
+			unsigned char* dst = (unsigned char*)&output[start];
+			if (compressedLength == rawLength) {
+				memcpy(dst, p, rawLength);
+			}
+			else if (!decompressBlock(p, p + compressedLength, dst, rawLength)) {
+				return false;
+			}
+			p += compressedLength;
+		}
+		return true;
+	}
+};
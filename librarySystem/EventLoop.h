@@ -0,0 +1,454 @@
+#pragma once
+
+// 'select' handles at most FD_SETSIZE sockets, which is only 64 by default on Windows. This only takes effect if nothing included winsock2.h first.
+#ifndef FD_SETSIZE
+#define FD_SETSIZE 4096
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <coroutine>
+#include <exception>
+#include <vector>
+#include <deque>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <utility>
+
+// This file provides C++20 coroutine versions of the socket calls used by the client and the server.
+// A coroutine that waits for a socket is suspended and costs only its coroutine frame, so one thread can run thousands of connections.
+// The 'EventLoop' uses 'select' to find which sockets are ready and resumes the coroutines waiting for them.
+// Everything runs on the thread that calls 'EventLoop::run', so coroutines must not be resumed or cancelled from other threads.
+// On Windows 'select' handles at most FD_SETSIZE sockets (64 by default), so define a larger FD_SETSIZE before including winsock2.h to run more connections.
+// Waiting on more sockets than that fails straight away with 'IoStatus::Error', instead of the extra sockets being silently left out of 'select'.
+
+// The result of waiting for a socket operation.
+enum class IoStatus { Ok, Closed, TimedOut, Cancelled, Error };
+
+// Passed to socket operations so they can be stopped early. Cancelling resumes every operation using the token with 'IoStatus::Cancelled'.
+struct CancelToken {
+	bool cancelled = false;
+
+	void cancel() {
+		cancelled = true;
+	}
+};
+
+// Switches a socket between blocking and non-blocking mode.
+inline bool setNonBlocking(SOCKET socket, bool nonBlocking) {
+	u_long mode = nonBlocking ? 1 : 0;
+	return ioctlsocket(socket, FIONBIO, &mode) == 0;
+}
+
+template <typename T>
+class Task;
+
+namespace taskDetail {
+	// When a task finishes, the coroutine that was awaiting it carries on.
+	struct FinalAwaiter {
+		bool await_ready() noexcept {
+			return false;
+		}
+
+		template <typename Promise>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+			std::coroutine_handle<> continuation = handle.promise().continuation;
+			return continuation ? continuation : std::noop_coroutine();
+		}
+
+		void await_resume() noexcept {}
+	};
+
+	struct PromiseBase {
+		std::coroutine_handle<> continuation;
+		std::exception_ptr error;
+
+		std::suspend_always initial_suspend() noexcept {
+			return {};
+		}
+
+		FinalAwaiter final_suspend() noexcept {
+			return {};
+		}
+
+		void unhandled_exception() {
+			error = std::current_exception();
+		}
+	};
+}
+
+// A coroutine that produces a value of type T. It starts when it is awaited ('co_await task') and returns its value to the awaiting coroutine.
+template <typename T>
+class Task {
+public:
+	struct promise_type : taskDetail::PromiseBase {
+		T value{};
+
+		Task get_return_object() {
+			return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+
+		void return_value(T result) {
+			value = std::move(result);
+		}
+	};
+
+	explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+	Task(Task&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+	Task(const Task&) = delete;
+	Task& operator=(const Task&) = delete;
+
+	~Task() {
+		if (handle) {
+			handle.destroy();
+		}
+	}
+
+	bool await_ready() const noexcept {
+		return false;
+	}
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+		handle.promise().continuation = awaiting;
+		return handle;
+	}
+
+	T await_resume() {
+		if (handle.promise().error) {
+			std::rethrow_exception(handle.promise().error);
+		}
+		return std::move(handle.promise().value);
+	}
+
+private:
+	std::coroutine_handle<promise_type> handle;
+};
+
+// A coroutine that doesn't produce a value.
+template <>
+class Task<void> {
+public:
+	struct promise_type : taskDetail::PromiseBase {
+		Task get_return_object() {
+			return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+
+		void return_void() {}
+	};
+
+	explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+	Task(Task&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+	Task(const Task&) = delete;
+	Task& operator=(const Task&) = delete;
+
+	~Task() {
+		if (handle) {
+			handle.destroy();
+		}
+	}
+
+	bool await_ready() const noexcept {
+		return false;
+	}
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+		handle.promise().continuation = awaiting;
+		return handle;
+	}
+
+	void await_resume() {
+		if (handle.promise().error) {
+			std::rethrow_exception(handle.promise().error);
+		}
+	}
+
+private:
+	std::coroutine_handle<promise_type> handle;
+};
+
+class EventLoop {
+private:
+	// A coroutine waiting for a socket to be ready, a timeout, or cancellation.
+	struct Waiter {
+		SOCKET socket;		// INVALID_SOCKET for a plain timer
+		bool write;
+		bool hasDeadline;
+		std::chrono::steady_clock::time_point deadline;
+		CancelToken* token;
+		IoStatus status;
+		std::coroutine_handle<> handle;
+	};
+
+	// Runs a spawned task to completion and then frees itself, as nothing awaits it.
+	struct Detached {
+		struct promise_type {
+			Detached get_return_object() {
+				return {};
+			}
+
+			std::suspend_never initial_suspend() noexcept {
+				return {};
+			}
+
+			std::suspend_never final_suspend() noexcept {
+				return {};
+			}
+
+			void return_void() {}
+
+			void unhandled_exception() {}
+		};
+	};
+
+	std::vector<Waiter*> waiters;
+	size_t socketWaiters = 0;	// How many of the waiters are waiting for a socket, which can't be more than FD_SETSIZE.
+	std::deque<std::coroutine_handle<>> ready;
+	bool stopped = false;
+
+	static Detached runDetached(Task<void> task) {
+		try {
+			co_await task;
+		}
+		catch (const std::exception&) {
+			// A failed spawned task only ends that task.
+		}
+	}
+
+public:
+	// Waits until the socket can be read from (or written to), the timeout passes, or the token is cancelled.
+	// A timeout below zero waits forever.
+	struct WaitAwaiter {
+		EventLoop& loop;
+		Waiter waiter;
+
+		bool await_ready() {
+			if (waiter.token && waiter.token->cancelled) {
+				waiter.status = IoStatus::Cancelled;
+				return true;
+			}
+			return false;
+		}
+
+		// Returning false resumes the coroutine straight away, which is used when there is no room left in the 'select' sets.
+		bool await_suspend(std::coroutine_handle<> handle) {
+			if (waiter.socket != INVALID_SOCKET) {
+				if (loop.socketWaiters >= (size_t)FD_SETSIZE) {
+					waiter.status = IoStatus::Error;
+					return false;
+				}
+				loop.socketWaiters++;
+			}
+			waiter.handle = handle;
+			loop.waiters.push_back(&waiter);
+			return true;
+		}
+
+		IoStatus await_resume() {
+			return waiter.status;
+		}
+	};
+
+	WaitAwaiter wait(SOCKET socket, bool write, long timeoutMs = -1, CancelToken* token = nullptr) {
+		Waiter waiter = { socket, write, timeoutMs >= 0, std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs < 0 ? 0 : timeoutMs), token, IoStatus::Ok, nullptr };
+		return WaitAwaiter{ *this, waiter };
+	}
+
+	// Suspends the coroutine for the given time. Returns 'IoStatus::TimedOut' when the time has passed.
+	WaitAwaiter sleep(long ms, CancelToken* token = nullptr) {
+		return wait(INVALID_SOCKET, false, ms, token);
+	}
+
+	// Starts a task that runs alongside the others, e.g. one task per connected client.
+	void spawn(Task<void> task) {
+		runDetached(std::move(task));
+	}
+
+	void stop() {
+		stopped = true;
+	}
+
+	// Runs until 'stop' is called or there is nothing left waiting.
+	void run() {
+		stopped = false;
+		while (!stopped && (!ready.empty() || !waiters.empty())) {
+			while (!ready.empty()) {
+				std::coroutine_handle<> handle = ready.front();
+				ready.pop_front();
+				handle.resume();
+			}
+			if (waiters.empty() || stopped) {
+				continue;
+			}
+
+			// Work out how long 'select' can wait for before the next timeout.
+			auto now = std::chrono::steady_clock::now();
+			bool anyDeadline = false, anySocket = false, anyCancelled = false;
+			auto nearest = now;
+			// Windows reports a failed connection attempt in the error set rather than the write set, so writers are in both.
+			fd_set readSet, writeSet, errorSet;
+			FD_ZERO(&readSet);
+			FD_ZERO(&writeSet);
+			FD_ZERO(&errorSet);
+			SOCKET maxSocket = 0;
+			for (Waiter* waiter : waiters) {
+				if (waiter->token && waiter->token->cancelled) {
+					anyCancelled = true;
+				}
+				if (waiter->hasDeadline && (!anyDeadline || waiter->deadline < nearest)) {
+					nearest = waiter->deadline;
+					anyDeadline = true;
+				}
+				if (waiter->socket != INVALID_SOCKET) {
+					FD_SET(waiter->socket, waiter->write ? &writeSet : &readSet);
+					if (waiter->write) {
+						FD_SET(waiter->socket, &errorSet);
+					}
+					maxSocket = waiter->socket > maxSocket ? waiter->socket : maxSocket;
+					anySocket = true;
+				}
+			}
+
+			long long waitMs = anyCancelled ? 0 : anyDeadline ? std::chrono::duration_cast<std::chrono::milliseconds>(nearest - now).count() : -1;
+			if (waitMs < -1) {
+				waitMs = 0;
+			}
+			if (anySocket) {
+				timeval timeout = { (long)(waitMs / 1000), (long)((waitMs % 1000) * 1000) };
+				if (select((int)maxSocket + 1, &readSet, &writeSet, &errorSet, waitMs < 0 ? NULL : &timeout) == SOCKET_ERROR) {
+					FD_ZERO(&readSet);
+					FD_ZERO(&writeSet);
+					FD_ZERO(&errorSet);
+				}
+			}
+			else if (waitMs > 0) {
+				// 'select' can't be used to wait without any sockets on Windows, so just sleep until the next timeout.
+				std::this_thread::sleep_for(std::chrono::milliseconds(waitMs));
+			}
+
+			// Resume every coroutine whose socket is ready, whose timeout has passed, or whose token was cancelled.
+			now = std::chrono::steady_clock::now();
+			std::vector<Waiter*> stillWaiting;
+			for (Waiter* waiter : waiters) {
+				if (waiter->socket != INVALID_SOCKET && (FD_ISSET(waiter->socket, waiter->write ? &writeSet : &readSet) || (waiter->write && FD_ISSET(waiter->socket, &errorSet)))) {
+					waiter->status = IoStatus::Ok;
+				}
+				else if (waiter->token && waiter->token->cancelled) {
+					waiter->status = IoStatus::Cancelled;
+				}
+				else if (waiter->hasDeadline && waiter->deadline <= now) {
+					waiter->status = IoStatus::TimedOut;
+				}
+				else {
+					stillWaiting.push_back(waiter);
+					continue;
+				}
+				if (waiter->socket != INVALID_SOCKET) {
+					socketWaiters--;
+				}
+				ready.push_back(waiter->handle);
+			}
+			waiters.swap(stillWaiting);
+		}
+	}
+};
+
+// A non-blocking socket whose operations are awaited, e.g. 'co_await socket.send(message)'.
+// The socket is not closed by this class.
+class AsyncSocket {
+private:
+	EventLoop& loop;
+	SOCKET socket;
+	CancelToken* token;
+
+	static bool wouldBlock() {
+		return WSAGetLastError() == WSAEWOULDBLOCK;
+	}
+
+public:
+	AsyncSocket(EventLoop& loop, SOCKET socket, CancelToken* token = nullptr) : loop(loop), socket(socket), token(token) {
+		setNonBlocking(socket, true);
+	}
+
+	SOCKET getSocket() const {
+		return socket;
+	}
+
+	// Sends the whole string, waiting whenever the socket's send buffer is full.
+	Task<IoStatus> send(const std::string& data, long timeoutMs = -1) {
+		size_t sent = 0;
+		while (sent < data.length()) {
+			int byteCount = ::send(socket, data.c_str() + sent, (int)(data.length() - sent), 0);
+			if (byteCount != SOCKET_ERROR) {
+				sent += byteCount;
+				continue;
+			}
+			if (!wouldBlock()) {
+				co_return IoStatus::Error;
+			}
+			IoStatus status = co_await loop.wait(socket, true, timeoutMs, token);
+			if (status != IoStatus::Ok) {
+				co_return status;
+			}
+		}
+		co_return IoStatus::Ok;
+	}
+
+	// Recieves whatever data is available, up to 4 KB, waiting until some arrives.
+	Task<IoStatus> recv(std::string& data, long timeoutMs = -1) {
+		while (true) {
+			char buffer[4096];
+			int byteCount = ::recv(socket, buffer, sizeof(buffer), 0);
+			if (byteCount > 0) {
+				data.assign(buffer, byteCount);
+				co_return IoStatus::Ok;
+			}
+			if (byteCount == 0) {
+				co_return IoStatus::Closed;
+			}
+			if (!wouldBlock()) {
+				co_return IoStatus::Error;
+			}
+			IoStatus status = co_await loop.wait(socket, false, timeoutMs, token);
+			if (status != IoStatus::Ok) {
+				co_return status;
+			}
+		}
+	}
+
+	// Waits for a connection on a listening socket. The new socket is also non-blocking.
+	Task<IoStatus> accept(SOCKET& client, long timeoutMs = -1) {
+		while (true) {
+			client = ::accept(socket, NULL, NULL);
+			if (client != INVALID_SOCKET) {
+				setNonBlocking(client, true);
+				co_return IoStatus::Ok;
+			}
+			if (!wouldBlock()) {
+				co_return IoStatus::Error;
+			}
+			IoStatus status = co_await loop.wait(socket, false, timeoutMs, token);
+			if (status != IoStatus::Ok) {
+				co_return status;
+			}
+		}
+	}
+
+	// Connects to a server, waiting until the connection is made or fails.
+	Task<IoStatus> connect(const sockaddr_in& address, long timeoutMs = -1) {
+		if (::connect(socket, (const sockaddr*)&address, sizeof(address)) != SOCKET_ERROR) {
+			co_return IoStatus::Ok;
+		}
+		if (!wouldBlock()) {
+			co_return IoStatus::Error;
+		}
+		IoStatus status = co_await loop.wait(socket, true, timeoutMs, token);
+		if (status != IoStatus::Ok) {
+			co_return status;
+		}
+		// The socket becomes writable when the connection attempt finishes, so check whether it succeeded.
+		int error = 0;
+		socklen_t length = sizeof(error);
+		getsockopt(socket, SOL_SOCKET, SO_ERROR, (char*)&error, &length);
+		co_return error == 0 ? IoStatus::Ok : IoStatus::Error;
+	}
+};
@@ -0,0 +1,247 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <string>
+
+// This file tracks how much memory the client and the server use, and which part of the program it belongs to.
+// It is opt-in: the tracking is only built when TRACK_MEMORY is defined (the Debug configurations define it). Otherwise the report says it is off and nothing is counted.
+//
+// When it is on, the global 'operator new' and 'operator delete' are replaced. Every allocation gets a small header holding its size and tag,
+// so freeing it takes the bytes off the right counters. The tag is whatever 'MemoryScope' is active on the thread when the memory is allocated.
+// The replacements are defined here, so this file must only be included in one source file per program (the client and the server are one file each).
+
+// The part of the program an allocation belongs to.
+enum class MemoryTag : unsigned char { Other, Catalog, Indexes, Network, Logging, Count };
+
+class MemoryTracker {
+private:
+	static const int tagCount = (int)MemoryTag::Count;
+	static const int sizeClasses = 32;	// Size class n holds blocks from 2^(n-1) + 1 to 2^n bytes.
+
+	// Every counter is atomic so allocations on different threads (e.g. the replication thread) can be counted at the same time.
+	inline static std::atomic<long long> liveBytes[tagCount];
+	inline static std::atomic<long long> peakBytes[tagCount];
+	inline static std::atomic<long long> allocations[tagCount];
+	inline static std::atomic<long long> allocatedBytes[tagCount];
+	inline static std::atomic<long long> liveBlocks[tagCount][sizeClasses];
+	inline static std::atomic<long long> liveBlockBytes[tagCount][sizeClasses];
+	inline static thread_local MemoryTag currentTag = MemoryTag::Other;
+
+	// Totals at the time of the last report, used to work out the allocation rates since then.
+	inline static std::mutex reportMutex;
+	inline static long long reportedAllocations[tagCount];
+	inline static long long reportedBytes[tagCount];
+	inline static std::chrono::steady_clock::time_point reportedTime = std::chrono::steady_clock::now();
+
+	static int sizeClass(size_t size) {
+		int sizeClassIndex = 0;
+		while (sizeClassIndex < sizeClasses - 1 && ((size_t)1 << sizeClassIndex) < size) {
+			sizeClassIndex++;
+		}
+		return sizeClassIndex;
+	}
+
+	static std::string formatBytes(long long bytes) {
+		if (bytes >= 10 * 1024 * 1024) {
+			return std::to_string(bytes / (1024 * 1024)) + " MB";
+		}
+		if (bytes >= 10 * 1024) {
+			return std::to_string(bytes / 1024) + " KB";
+		}
+		return std::to_string(bytes) + " B";
+	}
+
+public:
+	static const char* tagName(MemoryTag tag) {
+		static const char* names[] = { "other", "catalog", "indexes", "network", "logging" };
+		return names[(int)tag];
+	}
+
+	static bool enabled() {
+#ifdef TRACK_MEMORY
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	static MemoryTag getTag() {
+		return currentTag;
+	}
+
+	static void setTag(MemoryTag tag) {
+		currentTag = tag;
+	}
+
+	static void recordAllocation(MemoryTag tag, size_t size) {
+		int index = (int)tag;
+		long long live = liveBytes[index].fetch_add(size, std::memory_order_relaxed) + size;
+		long long peak = peakBytes[index].load(std::memory_order_relaxed);
+		while (live > peak && !peakBytes[index].compare_exchange_weak(peak, live, std::memory_order_relaxed)) {}
+		allocations[index].fetch_add(1, std::memory_order_relaxed);
+		allocatedBytes[index].fetch_add(size, std::memory_order_relaxed);
+		liveBlocks[index][sizeClass(size)].fetch_add(1, std::memory_order_relaxed);
+		liveBlockBytes[index][sizeClass(size)].fetch_add(size, std::memory_order_relaxed);
+	}
+
+	static void recordFree(MemoryTag tag, size_t size) {
+		int index = (int)tag;
+		liveBytes[index].fetch_sub(size, std::memory_order_relaxed);
+		liveBlocks[index][sizeClass(size)].fetch_sub(1, std::memory_order_relaxed);
+		liveBlockBytes[index][sizeClass(size)].fetch_sub(size, std::memory_order_relaxed);
+	}
+
+	// Returns one line per tag with the live bytes, peak bytes, total allocations and the allocation rate since the last report.
+	static std::string report() {
+		if (!enabled()) {
+			return "Memory tracking is off, build with TRACK_MEMORY defined to turn it on.\n";
+		}
+		std::lock_guard<std::mutex> guard(reportMutex);
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		double seconds = std::chrono::duration<double>(now - reportedTime).count();
+		reportedTime = now;
+
+		// The counters are read before the report string is built, because building it allocates memory too.
+		long long live[tagCount], peak[tagCount], count[tagCount], bytes[tagCount];
+		for (int i = 0; i < tagCount; i++) {
+			live[i] = liveBytes[i].load(std::memory_order_relaxed);
+			peak[i] = peakBytes[i].load(std::memory_order_relaxed);
+			count[i] = allocations[i].load(std::memory_order_relaxed);
+			bytes[i] = allocatedBytes[i].load(std::memory_order_relaxed);
+		}
+
+		std::string text = "Memory: live, peak, allocations, allocations/s and bytes/s over the last " + std::to_string((long long)(seconds * 1000)) + " ms\n";
+		long long totalLive = 0;
+		for (int i = 0; i < tagCount; i++) {
+			double allocationRate = seconds > 0 ? (count[i] - reportedAllocations[i]) / seconds : 0;
+			double byteRate = seconds > 0 ? (bytes[i] - reportedBytes[i]) / seconds : 0;
+			text += std::string(tagName((MemoryTag)i)) + ": " + formatBytes(live[i]) + ", peak " + formatBytes(peak[i]) + ", " + std::to_string(count[i]) + " allocations, "
+				+ std::to_string((long long)allocationRate) + "/s, " + formatBytes((long long)byteRate) + "/s\n";
+			reportedAllocations[i] = count[i];
+			reportedBytes[i] = bytes[i];
+			totalLive += live[i];
+		}
+		text += "total: " + formatBytes(totalLive) + "\n";
+		return text;
+	}
+
+	// Returns a snapshot of the heap: how many blocks are live for each tag and size class, and how many bytes they hold.
+	// This shows where the memory goes, e.g. many small string buffers compared to a few large vector buffers.
+	static std::string heapSnapshot() {
+		if (!enabled()) {
+			return "Memory tracking is off, build with TRACK_MEMORY defined to turn it on.\n";
+		}
+		long long blocks[tagCount][sizeClasses], bytes[tagCount][sizeClasses];
+		for (int i = 0; i < tagCount; i++) {
+			for (int j = 0; j < sizeClasses; j++) {
+				blocks[i][j] = liveBlocks[i][j].load(std::memory_order_relaxed);
+				bytes[i][j] = liveBlockBytes[i][j].load(std::memory_order_relaxed);
+			}
+		}
+
+		std::string text = "Heap snapshot: tag, block size, live blocks, live bytes\n";
+		for (int i = 0; i < tagCount; i++) {
+			for (int j = 0; j < sizeClasses; j++) {
+				if (blocks[i][j] > 0) {
+					text += std::string(tagName((MemoryTag)i)) + "\t<= " + formatBytes((long long)1 << j) + "\t" + std::to_string(blocks[i][j]) + "\t" + formatBytes(bytes[i][j]) + "\n";
+				}
+			}
+		}
+		return text;
+	}
+};
+
+// Sets the tag for memory allocated on this thread until the scope ends, then puts the previous tag back. Scopes can be nested.
+// A scope must not be held across a 'co_await', because other coroutines would run with its tag while this one is suspended.
+class MemoryScope {
+private:
+	MemoryTag previous;
+
+public:
+	explicit MemoryScope(MemoryTag tag) : previous(MemoryTracker::getTag()) {
+		MemoryTracker::setTag(tag);
+	}
+
+	~MemoryScope() {
+		MemoryTracker::setTag(previous);
+	}
+
+	MemoryScope(const MemoryScope&) = delete;
+	MemoryScope& operator=(const MemoryScope&) = delete;
+};
+
+#ifdef TRACK_MEMORY
+namespace memoryDetail {
+	// The header is 16 bytes so the memory after it keeps the alignment 'malloc' gives.
+	const size_t headerSize = 16;
+
+	inline void* allocate(size_t size) {
+		unsigned char* block = (unsigned char*)std::malloc(size + headerSize);
+		if (!block) {
+			return nullptr;
+		}
+		MemoryTag tag = MemoryTracker::getTag();
+		*(size_t*)block = size;
+		block[sizeof(size_t)] = (unsigned char)tag;
+		MemoryTracker::recordAllocation(tag, size);
+		return block + headerSize;
+	}
+
+	inline void release(void* memory) {
+		if (!memory) {
+			return;
+		}
+		unsigned char* block = (unsigned char*)memory - headerSize;
+		MemoryTracker::recordFree((MemoryTag)block[sizeof(size_t)], *(size_t*)block);
+		std::free(block);
+	}
+}
+
+void* operator new(size_t size) {
+	void* memory = memoryDetail::allocate(size);
+	if (!memory) {
+		throw std::bad_alloc();
+	}
+	return memory;
+}
+
+void* operator new[](size_t size) {
+	return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+	return memoryDetail::allocate(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+	return memoryDetail::allocate(size);
+}
+
+void operator delete(void* memory) noexcept {
+	memoryDetail::release(memory);
+}
+
+void operator delete[](void* memory) noexcept {
+	memoryDetail::release(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+	memoryDetail::release(memory);
+}
+
+void operator delete[](void* memory, size_t) noexcept {
+	memoryDetail::release(memory);
+}
+
+void operator delete(void* memory, const std::nothrow_t&) noexcept {
+	memoryDetail::release(memory);
+}
+
+void operator delete[](void* memory, const std::nothrow_t&) noexcept {
+	memoryDetail::release(memory);
+}
+#endif
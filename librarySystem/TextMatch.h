@@ -0,0 +1,270 @@
+#pragma once
+
+#include <string>
+#include <cstring>
+#include <cstdint>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define TEXT_MATCH_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TEXT_MATCH_AVX2
+#else
+#define TEXT_MATCH_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+// This class is the text matching used when searching the library, so a search for "the silent echo" finds "The Silent Echo".
+// A title or author is turned into a normalised key once, when the book is created or changed, and searches compare the keys byte for byte.
+// Normalising a text:
+//  - removes spaces at the start and end, and turns every run of spaces, tabs, new lines and non-breaking spaces into one space.
+//  - joins a letter followed by a combining accent (e.g. 'e' then U+0301) into the accented letter (U+00E9), so both ways of writing it in UTF-8 match.
+//    This covers the Latin-1 accented letters, which is the same as Unicode NFC for them.
+//  - folds upper case to lower case for ASCII, Latin-1, Latin Extended-A, Greek and Cyrillic. Other characters are kept as they are.
+// Bytes that aren't valid UTF-8 are kept as they are, so every text still has a key.
+//
+// Comparing keys first checks the lengths, then compares 32 bytes at a time with AVX2 or 16 bytes at a time with SSE2, and falls back to memcmp on other processors.
+class TextMatch {
+private:
+	// Reads one UTF-8 character. Returns false if the bytes aren't a valid UTF-8 character.
+	static bool decode(const unsigned char* p, const unsigned char* end, uint32_t& codePoint, size_t& length) {
+		if (p[0] < 0x80) {
+			codePoint = p[0];
+			length = 1;
+			return true;
+		}
+		if (p[0] >= 0xC2 && p[0] < 0xE0) {
+			length = 2;
+			codePoint = p[0] & 0x1F;
+		}
+		else if (p[0] >= 0xE0 && p[0] < 0xF0) {
+			length = 3;
+			codePoint = p[0] & 0x0F;
+		}
+		else if (p[0] >= 0xF0 && p[0] < 0xF5) {
+			length = 4;
+			codePoint = p[0] & 0x07;
+		}
+		else {
+			return false;
+		}
+		if ((size_t)(end - p) < length) {
+			return false;
+		}
+		for (size_t i = 1; i < length; i++) {
+			if ((p[i] & 0xC0) != 0x80) {
+				return false;
+			}
+			codePoint = (codePoint << 6) | (p[i] & 0x3F);
+		}
+		// Overlong forms, surrogates and values past U+10FFFF are not valid.
+		return !((length == 3 && codePoint < 0x800) || (length == 4 && (codePoint < 0x10000 || codePoint > 0x10FFFF)) || (codePoint >= 0xD800 && codePoint <= 0xDFFF));
+	}
+
+	static void encode(uint32_t codePoint, std::string& out) {
+		if (codePoint < 0x80) {
+			out.push_back((char)codePoint);
+		}
+		else if (codePoint < 0x800) {
+			out.push_back((char)(0xC0 | (codePoint >> 6)));
+			out.push_back((char)(0x80 | (codePoint & 0x3F)));
+		}
+		else if (codePoint < 0x10000) {
+			out.push_back((char)(0xE0 | (codePoint >> 12)));
+			out.push_back((char)(0x80 | ((codePoint >> 6) & 0x3F)));
+			out.push_back((char)(0x80 | (codePoint & 0x3F)));
+		}
+		else {
+			out.push_back((char)(0xF0 | (codePoint >> 18)));
+			out.push_back((char)(0x80 | ((codePoint >> 12) & 0x3F)));
+			out.push_back((char)(0x80 | ((codePoint >> 6) & 0x3F)));
+			out.push_back((char)(0x80 | (codePoint & 0x3F)));
+		}
+	}
+
+	static bool isSpace(uint32_t codePoint) {
+		return codePoint == ' ' || (codePoint >= '\t' && codePoint <= '\r') || codePoint == 0xA0;
+	}
+
+	static uint32_t foldCase(uint32_t codePoint) {
+		if (codePoint < 0x80) {
+			return (codePoint >= 'A' && codePoint <= 'Z') ? codePoint + 32 : codePoint;
+		}
+		if (codePoint >= 0xC0 && codePoint <= 0xDE && codePoint != 0xD7) {
+			return codePoint + 32;	// Latin-1, apart from the multiplication sign.
+		}
+		if (codePoint >= 0x100 && codePoint <= 0x17F) {
+			// Latin Extended-A is mostly upper and lower case pairs. U+0130 (dotted capital I) and U+0138 (kra) have no simple pair.
+			if (codePoint == 0x178) {
+				return 0xFF;
+			}
+			bool upperIsEven = codePoint <= 0x137 || (codePoint >= 0x14A && codePoint <= 0x177);
+			if (codePoint != 0x130 && codePoint != 0x138 && codePoint != 0x149 && codePoint != 0x17F && (codePoint % 2 == 0) == upperIsEven) {
+				return codePoint + 1;
+			}
+			return codePoint;
+		}
+		if (codePoint >= 0x391 && codePoint <= 0x3A9 && codePoint != 0x3A2) {
+			return codePoint + 32;	// Greek
+		}
+		if (codePoint == 0x3C2) {
+			return 0x3C3;	// Final sigma matches sigma.
+		}
+		if (codePoint >= 0x410 && codePoint <= 0x42F) {
+			return codePoint + 32;	// Cyrillic
+		}
+		if (codePoint >= 0x400 && codePoint <= 0x40F) {
+			return codePoint + 80;
+		}
+		return codePoint;
+	}
+
+	// Returns the accented letter made from a lower case letter and a combining accent, or 0 if there isn't one.
+	static uint32_t compose(uint32_t letter, uint32_t accent) {
+		struct Composition {
+			char letter;
+			unsigned short accent;
+			unsigned char composed;
+		};
+		static const Composition compositions[] = {
+			{ 'a', 0x300, 0xE0 }, { 'a', 0x301, 0xE1 }, { 'a', 0x302, 0xE2 }, { 'a', 0x303, 0xE3 }, { 'a', 0x308, 0xE4 }, { 'a', 0x30A, 0xE5 },
+			{ 'c', 0x327, 0xE7 },
+			{ 'e', 0x300, 0xE8 }, { 'e', 0x301, 0xE9 }, { 'e', 0x302, 0xEA }, { 'e', 0x308, 0xEB },
+			{ 'i', 0x300, 0xEC }, { 'i', 0x301, 0xED }, { 'i', 0x302, 0xEE }, { 'i', 0x308, 0xEF },
+			{ 'n', 0x303, 0xF1 },
+			{ 'o', 0x300, 0xF2 }, { 'o', 0x301, 0xF3 }, { 'o', 0x302, 0xF4 }, { 'o', 0x303, 0xF5 }, { 'o', 0x308, 0xF6 },
+			{ 'u', 0x300, 0xF9 }, { 'u', 0x301, 0xFA }, { 'u', 0x302, 0xFB }, { 'u', 0x308, 0xFC },
+			{ 'y', 0x301, 0xFD }, { 'y', 0x308, 0xFF },
+		};
+		if (accent < 0x300 || accent > 0x327 || letter < 'a' || letter > 'y') {
+			return 0;
+		}
+		for (const Composition& composition : compositions) {
+			if ((uint32_t)composition.letter == letter && composition.accent == accent) {
+				return composition.composed;
+			}
+		}
+		return 0;
+	}
+
+#ifdef TEXT_MATCH_X86
+	static bool hasAvx2() {
+#ifdef _MSC_VER
+		// AVX2 needs both the processor to support it (CPUID leaf 7) and Windows to save the AVX registers (OSXSAVE and XGETBV).
+		int info[4];
+		__cpuid(info, 0);
+		if (info[0] < 7) {
+			return false;
+		}
+		__cpuid(info, 1);
+		if ((info[2] & (1 << 27)) == 0 || (_xgetbv(0) & 6) != 6) {
+			return false;
+		}
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;
+#else
+		return __builtin_cpu_supports("avx2");
+#endif
+	}
+
+	// The last block overlaps the one before it when the length isn't a whole number of blocks, so there is no byte by byte tail.
+	static bool equalSse2(const char* a, const char* b, size_t length) {
+		if (length < 16) {
+			return memcmp(a, b, length) == 0;
+		}
+		for (size_t i = 0; ; i += 16) {
+			if (i + 16 > length) {
+				i = length - 16;
+			}
+			__m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+			__m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xFFFF) {
+				return false;
+			}
+			if (i + 16 == length) {
+				return true;
+			}
+		}
+	}
+
+	TEXT_MATCH_AVX2 static bool equalAvx2(const char* a, const char* b, size_t length) {
+		for (size_t i = 0; ; i += 32) {
+			if (i + 32 > length) {
+				i = length - 32;
+			}
+			__m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+			__m256i y = _mm256_loadu_si256((const __m256i*)(b + i));
+			if ((unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)) != 0xFFFFFFFFu) {
+				return false;
+			}
+			if (i + 32 == length) {
+				return true;
+			}
+		}
+	}
+#endif
+
+public:
+	// Returns the normalised key for a title or author.
+	static std::string normalise(const std::string& text) {
+		std::string key;
+		key.reserve(text.size());
+		const unsigned char* p = (const unsigned char*)text.data();
+		const unsigned char* end = p + text.size();
+		bool pendingSpace = false;	// A space is only written once the next character is, so there are no spaces at the end.
+
+		while (p < end) {
+			uint32_t codePoint, accent;
+			size_t length, accentLength;
+			if (!decode(p, end, codePoint, length)) {
+				if (pendingSpace) {
+					key.push_back(' ');
+					pendingSpace = false;
+				}
+				key.push_back((char)*p++);
+				continue;
+			}
+			p += length;
+			if (isSpace(codePoint)) {
+				pendingSpace = !key.empty();
+				continue;
+			}
+			codePoint = foldCase(codePoint);
+			if (p < end && decode(p, end, accent, accentLength)) {
+				uint32_t composed = compose(codePoint, accent);
+				if (composed) {
+					codePoint = composed;
+					p += accentLength;
+				}
+			}
+			if (pendingSpace) {
+				key.push_back(' ');
+				pendingSpace = false;
+			}
+			encode(codePoint, key);
+		}
+		return key;
+	}
+
+	// Returns true if two normalised keys are the same.
+	static bool equal(const std::string& a, const std::string& b) {
+		if (a.size() != b.size()) {
+			return false;
+		}
+#ifdef TEXT_MATCH_X86
+		static const bool avx2 = hasAvx2();
+		if (avx2 && a.size() >= 32) {
+			return equalAvx2(a.data(), b.data(), a.size());
+		}
+		return equalSse2(a.data(), b.data(), a.size());
+#else
+		return memcmp(a.data(), b.data(), a.size()) == 0;
+#endif
+	}
+
+	// Returns true if the texts are the same once they are normalised.
+	static bool matches(const std::string& a, const std::string& b) {
+		return equal(normalise(a), normalise(b));
+	}
+};
@@ -1,21 +1,1072 @@
+// Raises the number of sockets 'select' can wait on (64 by default on Windows), so the async server can run thousands of clients.
+#define FD_SETSIZE 4096
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#include <mswsock.h>
 #include <tchar.h>
 #include <iostream>
 #include <sstream>
 #include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <random>
+#include <chrono>
+#include <fstream>
+#include <cmath>
+#include <cstdint>
+#include <cerrno>
+#include <list>
+#include <unordered_map>
+#include <algorithm>
+#include "../Compression.h"
+#include "../EventLoop.h"
+#include "../MemoryTracker.h"
+#include "../TextMatch.h"
 
 using namespace std;
 
+// A single book record held by the server so it can check the changes sent by the client against its own copy of the library.
+// Titles and authors are looked up by their keys, so the server matches them the same way the client's library does (case, accents and spaces, see 'TextMatch').
+struct CatalogEntry {
+	string type;	// "Physical" or "Online"
+	string title;
+	string author;
+	string titleKey;	// 'title' and 'author' normalised by 'TextMatch::normalise'.
+	string authorKey;
+
+	static CatalogEntry make(const string& type, const string& title, const string& author) {
+		return { type, title, author, TextMatch::normalise(title), TextMatch::normalise(author) };
+	}
+};
+
+// A counting Bloom filter of book titles, used to reject lookups for titles the catalog doesn't have without searching it.
+// The catalog adds and looks up the normalised title keys, so a title written in a different case still gets through.
+// Each title sets 'hashCount' counters chosen by its hash. A title can only be in the catalog if all of its counters are above zero,
+// so a lookup is rejected if any of them is zero. Other titles can set the same counters, so a title that isn't there can still get through (a false positive).
+// Counters are used instead of single bits so a title can be removed again. A counter that reaches 255 stays there, as it no longer knows how many titles set it.
+class BloomFilter {
+private:
+	vector<unsigned char> counters;
+	int hashCount;
+	size_t capacity;	// The number of titles the filter was sized for.
+
+	// 64-bit FNV-1a hash. The two halves are combined to make each of the 'hashCount' positions (double hashing).
+	static uint64_t hashTitle(const string& title) {
+		uint64_t hash = 14695981039346656037ull;
+		for (unsigned char c : title) {
+			hash ^= c;
+			hash *= 1099511628211ull;
+		}
+		return hash;
+	}
+
+	size_t position(uint64_t hash, int i) const {
+		uint32_t h1 = (uint32_t)hash, h2 = (uint32_t)(hash >> 32) | 1;
+		return (h1 + (uint64_t)i * h2) % counters.size();
+	}
+
+public:
+	// The filter is sized straight away, so it can be used before 'reset' is called (an empty 'counters' would make 'position' divide by zero).
+	BloomFilter(size_t capacity = 1024, double falsePositiveRate = 0.01) {
+		reset(capacity, falsePositiveRate);
+	}
+
+	// Sizes the filter for 'capacity' titles (at least 1) at the given false positive rate and empties it.
+	// The standard sizes are m = -n ln(p) / ln(2)^2 counters and k = (m / n) ln(2) hashes.
+	void reset(size_t capacity, double falsePositiveRate) {
+		capacity = max((size_t)1, capacity);
+		this->capacity = capacity;
+		double size = -(double)capacity * log(falsePositiveRate) / (log(2.0) * log(2.0));
+		counters.assign((size_t)size + 1, 0);
+		hashCount = max(1, (int)round(size / capacity * log(2.0)));
+	}
+
+	void add(const string& title) {
+		uint64_t hash = hashTitle(title);
+		for (int i = 0; i < hashCount; i++) {
+			unsigned char& counter = counters[position(hash, i)];
+			if (counter < 255) {
+				counter++;
+			}
+		}
+	}
+
+	void remove(const string& title) {
+		uint64_t hash = hashTitle(title);
+		for (int i = 0; i < hashCount; i++) {
+			unsigned char& counter = counters[position(hash, i)];
+			if (counter > 0 && counter < 255) {
+				counter--;
+			}
+		}
+	}
+
+	// Returns false if the title is definitely not in the filter.
+	bool mightContain(const string& title) const {
+		uint64_t hash = hashTitle(title);
+		for (int i = 0; i < hashCount; i++) {
+			if (counters[position(hash, i)] == 0) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// The false positive rate expected with 'count' titles: (1 - e^(-kn/m))^k.
+	double expectedFalsePositiveRate(size_t count) const {
+		return pow(1 - exp(-(double)hashCount * count / counters.size()), hashCount);
+	}
+
+	size_t getCapacity() const {
+		return capacity;
+	}
+
+	size_t size() const {
+		return counters.size();
+	}
+
+	int getHashCount() const {
+		return hashCount;
+	}
+};
+
+// This class holds the server's copy of the library and applies the changes described by client messages to it.
+class Catalog {
+private:
+	vector<CatalogEntry> entries;
+
+	// Lookups by title check the Bloom filter first, so most titles that aren't in the catalog are rejected without a search.
+	// The filter is rebuilt at double the size when the catalog grows past the number of titles it was sized for, as the false positive rate rises after that.
+	BloomFilter titleFilter;
+	double falsePositiveRate = 0.01;
+	mutable unsigned long long filterLookups = 0;
+	mutable unsigned long long filterRejected = 0;
+	mutable unsigned long long filterFalsePositives = 0;	// Lookups the filter let through that then found nothing.
+
+	// The books added, removed or changed (before and after the change) since 'takeChanges' was last called,
+	// so the server's result cache can drop just the results those books appear in.
+	vector<CatalogEntry> changedBooks;
+	bool replaced = false;	// Set when the whole catalog is replaced, which can change any result.
+
+	// A change made by 'apply', kept by 'applyBatch' so it can be undone if a later change in the batch fails.
+	struct UndoStep {
+		char operation;	// 'a' added, 'd' deleted, 'c' changed
+		size_t index;	// Where the entry is (or was, for a delete).
+		CatalogEntry previous;	// The entry before it was deleted or changed.
+	};
+
+	// Undoes one change. The steps must be undone newest first so each index is still right.
+	void undo(const UndoStep& step) {
+		if (step.operation == 'a') {
+			titleFilter.remove(entries[step.index].titleKey);
+			entries.erase(entries.begin() + step.index);
+		}
+		else if (step.operation == 'd') {
+			entries.insert(entries.begin() + step.index, step.previous);
+			titleFilter.add(step.previous.titleKey);
+		}
+		else {
+			titleFilter.remove(entries[step.index].titleKey);
+			entries[step.index] = step.previous;
+			titleFilter.add(step.previous.titleKey);
+		}
+	}
+
+	// Checks the filter for a title key and counts the result.
+	bool mightHaveTitle(const string& titleKey) const {
+		filterLookups++;
+		if (!titleFilter.mightContain(titleKey)) {
+			filterRejected++;
+			return false;
+		}
+		return true;
+	}
+
+	// Returns the text between 'start' and 'end' in the message, or an empty string if either marker is missing.
+	// An empty 'end' returns everything after 'start'.
+	static string extractBetween(const string& message, const string& start, const string& end) {
+		size_t from = message.find(start);
+		if (from == string::npos) {
+			return "";
+		}
+		from += start.length();
+		if (end.empty()) {
+			return message.substr(from);
+		}
+		size_t to = message.find(end, from);
+		if (to == string::npos) {
+			return "";
+		}
+		return message.substr(from, to - from);
+	}
+
+public:
+	void addEntry(const string& type, const string& title, const string& author) {
+		MemoryScope scope(MemoryTag::Catalog);
+		entries.push_back(CatalogEntry::make(type, title, author));
+		changedBooks.push_back(entries.back());
+		if (entries.size() > titleFilter.getCapacity()) {
+			rebuildFilter();
+		}
+		else {
+			titleFilter.add(entries.back().titleKey);
+		}
+	}
+
+	// Sizes the filter for twice the current number of books (at least 1024) and adds every title again.
+	// Used when the catalog outgrows the filter, when the whole catalog is replaced and when the false positive rate is changed.
+	void rebuildFilter() {
+		MemoryScope scope(MemoryTag::Indexes);
+		titleFilter.reset(max((size_t)1024, entries.size() * 2), falsePositiveRate);
+		for (const CatalogEntry& entry : entries) {
+			titleFilter.add(entry.titleKey);
+		}
+	}
+
+	void setFalsePositiveRate(double rate) {
+		falsePositiveRate = rate;
+		rebuildFilter();
+	}
+
+	// Describes the Bloom filter: its size, the configured and expected false positive rates, and how many lookups it rejected.
+	string filterStats() const {
+		// The observed rate is the share of lookups for missing titles that the filter let through.
+		unsigned long long misses = filterRejected + filterFalsePositives;
+		double observed = misses > 0 ? (double)filterFalsePositives / misses : 0;
+		return "Bloom filter: " + to_string(titleFilter.size()) + " counters, " + to_string(titleFilter.getHashCount()) + " hashes, sized for " + to_string(titleFilter.getCapacity())
+			+ " titles, holding " + to_string(entries.size()) + "\n"
+			+ "False positive rate: configured " + to_string(falsePositiveRate) + ", expected " + to_string(titleFilter.expectedFalsePositiveRate(entries.size())) + ", observed " + to_string(observed) + "\n"
+			+ "Lookups: " + to_string(filterLookups) + ", rejected by filter " + to_string(filterRejected) + ", false positives " + to_string(filterFalsePositives) + "\n";
+	}
+
+	size_t size() const {
+		return entries.size();
+	}
+
+	const vector<CatalogEntry>& getEntries() const {
+		return entries;
+	}
+
+	void clear() {
+		entries.clear();
+		replaced = true;
+		rebuildFilter();
+	}
+
+	// Moves the changed books into 'books' and returns true if the whole catalog was replaced since the last call.
+	bool takeChanges(vector<CatalogEntry>& books) {
+		books.clear();
+		books.swap(changedBooks);
+		bool wasReplaced = replaced;
+		replaced = false;
+		return wasReplaced;
+	}
+
+	// Writes every book on its own line as "type<tab>title<tab>author". Used for listings, replica snapshots and snapshot files.
+	string serialize() const {
+		string data;
+		for (const CatalogEntry& entry : entries) {
+			data += entry.type + "\t" + entry.title + "\t" + entry.author + "\n";
+		}
+		return data;
+	}
+
+	// Replaces the catalog with the books in 'serialize' format.
+	void deserialize(const string& data) {
+		MemoryScope scope(MemoryTag::Catalog);
+		entries.clear();
+		stringstream ss(data);
+		string line;
+		while (getline(ss, line)) {
+			size_t first = line.find('\t');
+			size_t second = line.find('\t', first + 1);
+			if (first != string::npos && second != string::npos) {
+				entries.push_back(CatalogEntry::make(line.substr(0, first), line.substr(first + 1, second - first - 1), line.substr(second + 1)));
+			}
+		}
+		replaced = true;
+		rebuildFilter();
+	}
+
+	// Saves the catalog to a compressed snapshot file so it can be loaded when the server restarts.
+	// The first line is "Catalog snapshot <generation> <sequence>", the replication position the catalog is at, so a replica started from the file
+	// only needs the changes made after it. The file is written next to the old one and then renamed over it,
+	// so a save that fails part way (e.g. the disk is full) leaves the last snapshot as it was.
+	bool saveSnapshot(const string& path, unsigned long long generation, unsigned long long sequence) const {
+		string temporaryPath = path + ".tmp";
+		ofstream file(temporaryPath, ios::binary | ios::trunc);
+		string data = "Catalog snapshot " + to_string(generation) + " " + to_string(sequence) + "\n" + BlockCompressor::compress(serialize());
+		file.write(data.data(), data.size());
+		file.close();
+		if (!file || !MoveFileExA(temporaryPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+			remove(temporaryPath.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	// Loads the catalog from a snapshot file. Returns false, leaving the catalog unchanged, if the file is missing or invalid.
+	// 'generation' and 'sequence' are set to the replication position the snapshot was saved at, or 0 for a file saved before it was recorded.
+	bool loadSnapshot(const string& path, unsigned long long& generation, unsigned long long& sequence) {
+		ifstream file(path, ios::binary);
+		if (!file) {
+			return false;
+		}
+		stringstream contents;
+		contents << file.rdbuf();
+		string compressed = contents.str();
+		generation = sequence = 0;
+		if (compressed.rfind("Catalog snapshot ", 0) == 0) {
+			size_t lineEnd = compressed.find('\n');
+			stringstream header(compressed.substr(17, lineEnd == string::npos ? string::npos : lineEnd - 17));
+			if (lineEnd == string::npos || !(header >> generation >> sequence)) {
+				return false;
+			}
+			compressed.erase(0, lineEnd + 1);
+		}
+		string data;
+		if (!BlockCompressor::decompress(compressed, data)) {
+			return false;
+		}
+		deserialize(data);
+		return true;
+	}
+
+	// Lists the books with a matching type and author in 'serialize' format. An empty type or author matches any book.
+	string serializeMatching(const string& type, const string& author) const {
+		string data;
+		string authorKey = TextMatch::normalise(author);
+		for (const CatalogEntry& entry : entries) {
+			if ((type.empty() || entry.type == type) && (author.empty() || TextMatch::equal(entry.authorKey, authorKey))) {
+				data += entry.type + "\t" + entry.title + "\t" + entry.author + "\n";
+			}
+		}
+		return data;
+	}
+
+	// Returns the first book with a matching title, or nullptr if there isn't one.
+	const CatalogEntry* findByTitle(const string& title) const {
+		string key = TextMatch::normalise(title);
+		if (!mightHaveTitle(key)) {
+			return nullptr;
+		}
+		for (const CatalogEntry& entry : entries) {
+			if (TextMatch::equal(entry.titleKey, key)) {
+				return &entry;
+			}
+		}
+		filterFalsePositives++;
+		return nullptr;
+	}
+
+	// Applies one client message to the catalog.
+	// Returns "OK" if the change was made, otherwise a short reason why it could not be applied.
+	// When 'undoSteps' is given, a step that undoes the change is added to it (see 'applyBatch').
+	string apply(const string& message, vector<UndoStep>* undoSteps = nullptr) {
+		MemoryScope scope(MemoryTag::Catalog);
+		if (message.rfind("New ", 0) == 0) {
+			string type = extractBetween(message, "New ", " Book added");
+			string title = extractBetween(message, "titled: ", ", author: ");
+			string author = extractBetween(message, ", author: ", "");
+			if ((type != "Physical" && type != "Online") || title.empty()) {
+				return "INVALID";
+			}
+			addEntry(type, title, author);
+			if (undoSteps) {
+				undoSteps->push_back({ 'a', entries.size() - 1, CatalogEntry() });
+			}
+			return "OK";
+		}
+		if (message.rfind("Deleted ", 0) == 0) {
+			// The author is matched too, so the right book is deleted when several share a title.
+			string key = TextMatch::normalise(extractBetween(message, "titled: ", ", author: "));
+			string authorKey = TextMatch::normalise(extractBetween(message, ", author: ", ""));
+			if (!mightHaveTitle(key)) {
+				return "NOT FOUND";
+			}
+			for (auto it = entries.begin(); it != entries.end(); ++it) {
+				if (TextMatch::equal(it->titleKey, key) && TextMatch::equal(it->authorKey, authorKey)) {
+					titleFilter.remove(key);
+					changedBooks.push_back(*it);
+					if (undoSteps) {
+						undoSteps->push_back({ 'd', (size_t)(it - entries.begin()), *it });
+					}
+					entries.erase(it);
+					return "OK";
+				}
+			}
+			filterFalsePositives++;
+			return "NOT FOUND";
+		}
+		if (message.rfind("Book title updated", 0) == 0 || message.rfind("Book author updated", 0) == 0) {
+			bool isTitle = message.rfind("Book title", 0) == 0;
+			string from = extractBetween(message, "from: ", ", to: ");
+			// An author change also names the title of the book, so the right book is changed when several share an author.
+			string title = extractBetween(message, ", title: ", "");
+			string to = title.empty() ? extractBetween(message, ", to: ", "") : extractBetween(message, ", to: ", ", title: ");
+			string fromKey = TextMatch::normalise(from), titleKey = TextMatch::normalise(title);
+			// A title change looks up the old title. An author change can only be checked when it names the title.
+			const string& filterTitle = isTitle ? fromKey : titleKey;
+			bool checkedFilter = !filterTitle.empty();
+			if (checkedFilter && !mightHaveTitle(filterTitle)) {
+				return "NOT FOUND";
+			}
+			// The client modifies the first book it finds with a matching title or author, so the server does the same.
+			for (CatalogEntry& entry : entries) {
+				if (TextMatch::equal(isTitle ? entry.titleKey : entry.authorKey, fromKey) && (title.empty() || TextMatch::equal(entry.titleKey, titleKey))) {
+					changedBooks.push_back(entry);
+					if (undoSteps) {
+						undoSteps->push_back({ 'c', (size_t)(&entry - &entries[0]), entry });
+					}
+					if (isTitle) {
+						titleFilter.remove(entry.titleKey);
+						entry.title = to;
+						entry.titleKey = TextMatch::normalise(to);
+						titleFilter.add(entry.titleKey);
+					}
+					else {
+						entry.author = to;
+						entry.authorKey = TextMatch::normalise(to);
+					}
+					changedBooks.push_back(entry);
+					return "OK";
+				}
+			}
+			if (checkedFilter) {
+				filterFalsePositives++;
+			}
+			return "NOT FOUND";
+		}
+		return "INVALID";
+	}
+
+	// Applies a list of changes all or nothing and returns how many of them failed.
+	// Every change is applied to the catalog and recorded, so if any of them failed only those changes are undone (newest first)
+	// instead of the whole catalog being copied for every batch. 'statuses' gets one entry per change.
+	size_t applyBatch(const vector<string>& changes, vector<string>& statuses) {
+		MemoryScope scope(MemoryTag::Catalog);
+		vector<UndoStep> undoSteps;
+		size_t changedCount = changedBooks.size();
+		size_t failed = 0;
+		statuses.clear();
+		for (const string& change : changes) {
+			statuses.push_back(apply(change, &undoSteps));
+			if (statuses.back() != "OK") {
+				failed++;
+			}
+		}
+		if (failed > 0) {
+			for (auto it = undoSteps.rbegin(); it != undoSteps.rend(); ++it) {
+				undo(*it);
+			}
+			changedBooks.resize(changedCount);	// Nothing changed, so no cached results need to be dropped.
+		}
+		return failed;
+	}
+};
+
+// A bounded cache of query results, kept by the server so popular queries (e.g. an author's books or a type listing) aren't worked out again on every request.
+// Results are kept by their normalised query (see 'ServerSocket::normalizeQuery'), and the cache is limited by the bytes its results use.
+// It uses a segmented LRU policy. A new result goes into the probation segment, and only moves into the protected segment if it is asked for again.
+// When the cache is full the least recently used probation results are evicted first, so a burst of one-off queries can't push out the popular ones.
+// When the protected segment is over its share of the cache, its least recently used results move back to probation.
+class ResultCache {
+private:
+	struct CacheEntry {
+		string query;
+		string result;
+	};
+
+	struct Location {
+		bool isProtected;
+		list<CacheEntry>::iterator entry;
+	};
+
+	list<CacheEntry> probation;		// Most recently used first.
+	list<CacheEntry> protectedSegment;	// Most recently used first.
+	unordered_map<string, Location> index;
+	size_t capacityBytes;
+	size_t probationBytes = 0;
+	size_t protectedBytes = 0;
+	unsigned long long hits = 0, misses = 0, evictions = 0, invalidations = 0;
+
+	// The bytes a result uses, including an estimate for the list node and index entry.
+	static size_t entryBytes(const CacheEntry& entry) {
+		return entry.query.size() * 2 + entry.result.size() + 96;
+	}
+
+	size_t protectedCapacity() const {
+		return capacityBytes / 5 * 4;
+	}
+
+	// The location is copied because erasing the index entry would otherwise destroy it.
+	void erase(Location location) {
+		(location.isProtected ? protectedBytes : probationBytes) -= entryBytes(*location.entry);
+		index.erase(location.entry->query);
+		(location.isProtected ? protectedSegment : probation).erase(location.entry);
+	}
+
+	// Moves results from the protected segment back to probation until it fits its share, then evicts from probation (or protected if it is empty) until the cache fits.
+	void shrink() {
+		while (protectedBytes > protectedCapacity()) {
+			size_t bytes = entryBytes(protectedSegment.back());
+			probation.splice(probation.begin(), protectedSegment, prev(protectedSegment.end()));
+			index[probation.front().query] = { false, probation.begin() };
+			protectedBytes -= bytes;
+			probationBytes += bytes;
+		}
+		while (probationBytes + protectedBytes > capacityBytes) {
+			list<CacheEntry>& segment = probation.empty() ? protectedSegment : probation;
+			erase({ &segment == &protectedSegment, prev(segment.end()) });
+			evictions++;
+		}
+	}
+
+public:
+	explicit ResultCache(size_t capacityBytes) : capacityBytes(capacityBytes) {}
+
+	void setCapacity(size_t bytes) {
+		capacityBytes = bytes;
+		shrink();
+	}
+
+	// Returns the cached result for a query, or nullptr if it isn't cached. A result found in probation moves to the protected segment.
+	const string* find(const string& query) {
+		auto found = index.find(query);
+		if (found == index.end()) {
+			misses++;
+			return nullptr;
+		}
+		hits++;
+		Location& location = found->second;
+		if (!location.isProtected) {
+			size_t bytes = entryBytes(*location.entry);
+			probationBytes -= bytes;
+			protectedBytes += bytes;
+		}
+		protectedSegment.splice(protectedSegment.begin(), location.isProtected ? protectedSegment : probation, location.entry);
+		location = { true, protectedSegment.begin() };
+		const string* result = &protectedSegment.front().result;
+		shrink();
+		return index.count(query) ? result : nullptr;
+	}
+
+	// Adds a result to the probation segment. Results larger than a quarter of the cache aren't kept, so one huge listing can't empty the cache.
+	void insert(const string& query, const string& result) {
+		MemoryScope scope(MemoryTag::Indexes);
+		if (index.count(query) || query.size() * 2 + result.size() + 96 > capacityBytes / 4) {
+			return;
+		}
+		probation.push_front({ query, result });
+		index[query] = { false, probation.begin() };
+		probationBytes += entryBytes(probation.front());
+		shrink();
+	}
+
+	// Removes the cached result for a query, if there is one.
+	void invalidate(const string& query) {
+		auto found = index.find(query);
+		if (found != index.end()) {
+			erase(found->second);
+			invalidations++;
+		}
+	}
+
+	void clear() {
+		invalidations += index.size();
+		index.clear();
+		probation.clear();
+		protectedSegment.clear();
+		probationBytes = protectedBytes = 0;
+	}
+
+	string stats() const {
+		double hitRate = (hits + misses) > 0 ? (double)hits / (hits + misses) : 0;
+		return "Result cache: " + to_string(index.size()) + " results, " + to_string(probationBytes + protectedBytes) + " of " + to_string(capacityBytes) + " bytes ("
+			+ to_string(protectedBytes) + " protected)\n"
+			+ "Hits: " + to_string(hits) + ", misses " + to_string(misses) + ", hit rate " + to_string(hitRate) + ", evictions " + to_string(evictions) + ", invalidations " + to_string(invalidations) + "\n";
+	}
+};
+
+// One committed request in the primary server's change log. A batch is kept as a single entry so replicas also apply it all or nothing.
+struct LogEntry {
+	unsigned long long sequence;
+	long long timestampMs;	// When the primary committed the change, used by replicas to work out how far behind they are.
+	vector<string> changes;
+};
+
+// This class streams the server's ordered change log from a primary server to replica servers.
+// The primary listens on a separate replication port. A replica connects to it, sends "Sync <generation> <last sequence applied> LZ" and then applies every change it is sent in order.
+// The generation is a random number the primary picks when it starts, so a replica that followed an earlier run of the primary (whose sequence numbers mean different changes) is sent a snapshot.
+// If the replica is further behind than the changes the primary still keeps, it is sent a snapshot of the whole catalog instead.
+// A replica that sees a gap in the sequence numbers drops the connection and syncs again. One that can't apply a change asks for a snapshot.
+// Each time the primary sends a replica more data it starts with "Head <sequence>", its newest change at that moment, so the replica can report how many changes it is behind.
+// "LZ" asks for the snapshot to be compressed with 'BlockCompressor'; a replica that leaves it out is sent an uncompressed snapshot.
+// Replicas only answer read-only requests, so clients must send changes to the primary.
+class Replication {
+private:
+	Catalog& catalog;
+	mutex catalogMutex;				// Guards the catalog, the log and the replica list as they are used by the client and replication threads.
+	deque<LogEntry> log;			// The most recent changes, oldest first.
+	size_t maxLogEntries;			// Older changes are dropped, and replicas that need them are sent a snapshot.
+	unsigned long long headSequence;	// Sequence of the newest change (on a replica, the primary's head as it last reported it).
+	unsigned long long appliedSequence;	// Sequence of the newest change applied to this catalog.
+	long long lagMs;				// How long the newest applied change took to reach this replica.
+	bool replica;
+	unsigned long long generation;	// Primary: picked at start. Replica: the generation of the primary the catalog came from (0 before the first snapshot).
+
+	// A connected replica (primary only). Changes are queued here with the catalog locked, and a thread per replica sends them
+	// without the lock, so a slow replica doesn't hold up client requests.
+	struct ReplicaLink {
+		SOCKET socket;
+		mutex queueMutex;
+		condition_variable queued;
+		string outgoing;	// Data waiting to be sent.
+		bool closed = false;	// Set by the sender when the replica can't be sent to, or by 'record' when it has fallen too far behind.
+	};
+	vector<shared_ptr<ReplicaLink>> replicas;
+	atomic<unsigned long long> primaryHead{ 0 };	// Primary: the newest recorded change, read by the sender threads without the catalog lock.
+	static const size_t maxQueuedBytes = 64 * 1024 * 1024;	// A replica with more than this waiting is dropped, and is sent a snapshot when it reconnects.
+
+	static long long nowMs() {
+		return chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count();
+	}
+
+	// Sends the whole string, as 'send' may not send it all at once.
+	static bool sendAll(SOCKET socket, const string& data) {
+		size_t sent = 0;
+		while (sent < data.length()) {
+			int byteCount = send(socket, data.c_str() + sent, data.length() - sent, 0);
+			if (byteCount == SOCKET_ERROR) {
+				return false;
+			}
+			sent += byteCount;
+		}
+		return true;
+	}
+
+	// Reads one line from the socket. Data recieved after the line is kept in 'pending' for the next call.
+	static bool readLine(SOCKET socket, string& pending, string& line) {
+		size_t end;
+		while ((end = pending.find('\n')) == string::npos) {
+			char buffer[4096];
+			int byteCount = recv(socket, buffer, sizeof(buffer), 0);
+			if (byteCount <= 0) {
+				return false;
+			}
+			pending.append(buffer, byteCount);
+		}
+		line = pending.substr(0, end);
+		pending.erase(0, end + 1);
+		return true;
+	}
+
+	// Reads exactly 'count' bytes from the socket, starting with any data already in 'pending'.
+	static bool readBytes(SOCKET socket, string& pending, size_t count, string& data) {
+		while (pending.length() < count) {
+			char buffer[4096];
+			int byteCount = recv(socket, buffer, sizeof(buffer), 0);
+			if (byteCount <= 0) {
+				return false;
+			}
+			pending.append(buffer, byteCount);
+		}
+		data = pending.substr(0, count);
+		pending.erase(0, count);
+		return true;
+	}
+
+	// Formats a log entry for sending to a replica: a header line followed by one line per change.
+	string formatEntry(const LogEntry& entry) const {
+		string data = "Change " + to_string(entry.sequence) + " " + to_string(entry.timestampMs) + " " + to_string(entry.changes.size()) + "\n";
+		for (const string& change : entry.changes) {
+			data += change + "\n";
+		}
+		return data;
+	}
+
+	// Formats the whole catalog so a replica can replace its copy with it.
+	// The header line gives the size of the data that follows and whether it is compressed.
+	string formatSnapshot(bool compress) const {
+		string data = compress ? BlockCompressor::compress(catalog.serialize()) : catalog.serialize();
+		return "Snapshot " + to_string(generation) + " " + to_string(appliedSequence) + " " + to_string(nowMs()) + " " + to_string(data.size()) + (compress ? " LZ" : " raw") + "\n" + data;
+	}
+
+	// Primary: accepts replicas on the replication port and brings each one up to date before adding it to the replica list.
+	void acceptReplicas(SOCKET listenSocket) {
+		MemoryScope scope(MemoryTag::Network);
+		while (true) {
+			SOCKET replicaSocket = accept(listenSocket, NULL, NULL);
+			if (replicaSocket == INVALID_SOCKET) {
+				cout << "Replication accept failed: " << WSAGetLastError() << endl;
+				return;
+			}
+
+			// The handshake comes from the network, so a line that isn't "Sync <generation> <sequence>" closes the connection.
+			string pending, line;
+			unsigned long long replicaGeneration, replicaSequence;
+			if (!readLine(replicaSocket, pending, line) || !parseSync(line, replicaGeneration, replicaSequence)) {
+				cout << "Replication: invalid handshake from replica" << endl;
+				closesocket(replicaSocket);
+				continue;
+			}
+			bool compress = line.find(" LZ") != string::npos;
+
+			// The catch-up is queued before the replica is in the list, with the lock held, so no change can be committed in between and missed.
+			// It is sent by the replica's own thread once the lock is released.
+			shared_ptr<ReplicaLink> link = make_shared<ReplicaLink>();
+			link->socket = replicaSocket;
+			lock_guard<mutex> guard(catalogMutex);
+			string& catchUp = link->outgoing;
+			if (replicaGeneration == generation && replicaSequence == appliedSequence) {
+				// Already up to date.
+			}
+			else if (replicaGeneration != generation || replicaSequence > appliedSequence || log.empty() || log.front().sequence > replicaSequence + 1) {
+				catchUp = formatSnapshot(compress);
+			}
+			else {
+				for (const LogEntry& entry : log) {
+					if (entry.sequence > replicaSequence) {
+						catchUp += formatEntry(entry);
+					}
+				}
+			}
+			replicas.push_back(link);
+			thread(&Replication::sendToReplica, this, link).detach();
+			cout << "Replica connected at sequence " << replicaSequence << (catchUp.rfind("Snapshot", 0) == 0 ? ", sent snapshot" : "") << endl;
+		}
+	}
+
+	// Reads a "Sync <generation> <sequence>" line. Returns false if either number is missing or isn't a valid number.
+	static bool parseSync(const string& line, unsigned long long& replicaGeneration, unsigned long long& replicaSequence) {
+		if (line.rfind("Sync ", 0) != 0) {
+			return false;
+		}
+		const char* start = line.c_str() + 5;
+		char* end;
+		for (unsigned long long* number : { &replicaGeneration, &replicaSequence }) {
+			if (*start < '0' || *start > '9') {
+				return false;
+			}
+			errno = 0;
+			*number = strtoull(start, &end, 10);
+			if (errno == ERANGE || (*end != ' ' && *end != '\0')) {
+				return false;
+			}
+			start = *end == ' ' ? end + 1 : end;
+		}
+		return true;
+	}
+
+	// Primary: sends a replica's queued data until it can't be sent to. Runs in its own thread and closes the socket when it finishes.
+	// Each send starts with the primary's head as it is now, which is ahead of the queued changes when the replica is behind.
+	void sendToReplica(shared_ptr<ReplicaLink> link) {
+		MemoryScope scope(MemoryTag::Network);
+		string data;
+		while (true) {
+			{
+				unique_lock<mutex> guard(link->queueMutex);
+				link->queued.wait(guard, [&] { return link->closed || !link->outgoing.empty(); });
+				if (link->closed) {
+					break;
+				}
+				data = "Head " + to_string(primaryHead.load()) + "\n";
+				data += link->outgoing;
+				link->outgoing.clear();
+			}
+			if (!sendAll(link->socket, data)) {
+				lock_guard<mutex> guard(link->queueMutex);
+				link->closed = true;
+				break;
+			}
+			data.clear();
+		}
+		closesocket(link->socket);
+	}
+
+	// Replica: connects to the primary and applies the changes it streams, reconnecting if the connection is lost.
+	void followPrimary(sockaddr_in primaryAddress) {
+		MemoryScope scope(MemoryTag::Network);
+		while (true) {
+			SOCKET primarySocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+			if (primarySocket != INVALID_SOCKET && connect(primarySocket, (SOCKADDR*)&primaryAddress, sizeof(primaryAddress)) != SOCKET_ERROR) {
+				unsigned long long sequence, followedGeneration;
+				{
+					lock_guard<mutex> guard(catalogMutex);
+					sequence = appliedSequence;
+					followedGeneration = generation;
+				}
+				if (sendAll(primarySocket, "Sync " + to_string(followedGeneration) + " " + to_string(sequence) + " LZ\n")) {
+					cout << "Replica: following primary from sequence " << sequence << endl;
+					applyStream(primarySocket);
+				}
+				cout << "Replica: lost connection to primary, retrying..." << endl;
+			}
+			if (primarySocket != INVALID_SOCKET) {
+				closesocket(primarySocket);
+			}
+			this_thread::sleep_for(chrono::seconds(1));
+		}
+	}
+
+	// Replica: reads snapshots and changes from the primary until the connection closes.
+	void applyStream(SOCKET primarySocket) {
+		string pending, line;
+		while (readLine(primarySocket, pending, line)) {
+			stringstream header(line);
+			string kind;
+			unsigned long long sequence, snapshotGeneration = 0;
+			long long timestamp;
+			size_t count;
+			header >> kind;
+			if (kind == "Head") {
+				if (header >> sequence) {
+					lock_guard<mutex> guard(catalogMutex);
+					headSequence = max(sequence, appliedSequence);
+				}
+				continue;
+			}
+			if (kind == "Snapshot") {
+				header >> snapshotGeneration;
+			}
+			header >> sequence >> timestamp >> count;
+			if (!header) {
+				cout << "Replica: invalid message from primary" << endl;
+				return;
+			}
+
+			// A snapshot is followed by 'count' bytes of catalog data, a change by 'count' lines.
+			string snapshot, encoding;
+			vector<string> lines;
+			if (kind == "Snapshot") {
+				header >> encoding;
+				if (!readBytes(primarySocket, pending, count, snapshot)) {
+					return;
+				}
+				if (encoding == "LZ") {
+					string compressed = snapshot;
+					if (!BlockCompressor::decompress(compressed, snapshot)) {
+						cout << "Replica: invalid snapshot from primary" << endl;
+						return;
+					}
+				}
+			}
+			else {
+				lines.resize(count);
+				for (size_t i = 0; i < count; i++) {
+					if (!readLine(primarySocket, pending, lines[i])) {
+						return;
+					}
+				}
+			}
+
+			lock_guard<mutex> guard(catalogMutex);
+			if (kind == "Snapshot") {
+				catalog.deserialize(snapshot);
+				generation = snapshotGeneration;
+				headSequence = sequence;
+			}
+			else if (kind == "Change" && sequence == appliedSequence + 1) {
+				// The primary only logs changes it committed, so they are applied straight to the catalog without staging a copy.
+				// A change that fails means this catalog no longer matches the primary's. The generation is cleared so the next sync sends a snapshot.
+				for (const string& change : lines) {
+					string status = catalog.apply(change);
+					if (status != "OK") {
+						cout << "Replica: change " << sequence << " failed (" << status << "), asking for a snapshot" << endl;
+						generation = 0;
+						return;
+					}
+				}
+			}
+			else if (kind == "Change" && sequence > appliedSequence + 1) {
+				// A change was missed, so none of the following ones can be applied. Syncing again fills the gap (or sends a snapshot).
+				cout << "Replica: missed changes " << appliedSequence + 1 << " to " << sequence - 1 << ", syncing again" << endl;
+				return;
+			}
+			else {
+				continue; // Already applied or not a known message.
+			}
+			appliedSequence = sequence;
+			headSequence = max(headSequence, sequence);
+			lagMs = nowMs() - timestamp;
+		}
+	}
+
+public:
+	Replication(Catalog& catalog, size_t maxLogEntries = 10000) : catalog(catalog), maxLogEntries(maxLogEntries), headSequence(0), appliedSequence(0), lagMs(0), replica(false), generation(0) {}
+
+	// Used by the server to lock the catalog while it reads or changes it.
+	mutex& getMutex() {
+		return catalogMutex;
+	}
+
+	bool isReplica() const {
+		return replica;
+	}
+
+	// The replication position of the catalog, saved with snapshot files. Must be called with the mutex locked.
+	unsigned long long getGeneration() const {
+		return generation;
+	}
+
+	unsigned long long getSequence() const {
+		return appliedSequence;
+	}
+
+	// Sets the position of a catalog loaded from a snapshot file, before replication starts.
+	// A replica syncs from there, so it only needs the changes after it if the primary is still on the same generation.
+	// A primary carries on numbering from the sequence but starts a new generation, because changes it made after the snapshot was saved are lost.
+	void restore(unsigned long long savedGeneration, unsigned long long sequence) {
+		generation = savedGeneration;
+		appliedSequence = headSequence = sequence;
+		primaryHead = sequence;
+	}
+
+	// Primary: records committed changes as one log entry and queues it for every replica.
+	// Must be called with the mutex locked. A replica that can't be sent to, or has too much waiting, is dropped and will catch up when it reconnects.
+	void record(const vector<string>& changes) {
+		MemoryScope scope(MemoryTag::Logging);
+		LogEntry entry = { ++appliedSequence, nowMs(), changes };
+		headSequence = appliedSequence;
+		primaryHead = appliedSequence;
+		log.push_back(entry);
+		if (log.size() > maxLogEntries) {
+			log.pop_front();
+		}
+
+		string data = formatEntry(entry);
+		for (auto it = replicas.begin(); it != replicas.end();) {
+			ReplicaLink& link = **it;
+			bool closed;
+			{
+				lock_guard<mutex> guard(link.queueMutex);
+				if (!link.closed && link.outgoing.size() + data.size() > maxQueuedBytes) {
+					cout << "Replication: replica is too far behind, dropping it" << endl;
+					link.closed = true;
+				}
+				if (!link.closed) {
+					link.outgoing += data;
+				}
+				closed = link.closed;
+			}
+			link.queued.notify_one();
+			if (closed) {
+				it = replicas.erase(it);	// The sender thread closes the socket.
+			}
+			else {
+				++it;
+			}
+		}
+	}
+
+	// Primary: starts listening for replicas on the replication port in a background thread.
+	bool startPrimary(int port, const char* ipAddress) {
+		sockaddr_in address;
+		memset(&address, 0, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_port = htons(port);
+		SOCKET listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (listenSocket == INVALID_SOCKET || InetPtonA(AF_INET, ipAddress, &address.sin_addr.s_addr) != 1 ||
+			bind(listenSocket, (SOCKADDR*)&address, sizeof(address)) == SOCKET_ERROR || listen(listenSocket, SOMAXCONN) == SOCKET_ERROR) {
+			cout << "Replication: failed to listen on port " << port << ": " << WSAGetLastError() << endl;
+			if (listenSocket != INVALID_SOCKET) {
+				closesocket(listenSocket);
+			}
+			return false;
+		}
+		random_device random;
+		generation = (((unsigned long long)random() << 32) | random()) | 1;	// Never 0, which a replica sends before its first snapshot.
+		cout << "Replication: primary listening for replicas on port " << port << endl;
+		thread(&Replication::acceptReplicas, this, listenSocket).detach();
+		return true;
+	}
+
+	// Replica: starts following the primary's replication port in a background thread.
+	bool startReplica(int primaryPort, const char* primaryIpAddress) {
+		sockaddr_in address;
+		memset(&address, 0, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_port = htons(primaryPort);
+		if (InetPtonA(AF_INET, primaryIpAddress, &address.sin_addr.s_addr) != 1) {
+			cout << "Replication: invalid primary IP address." << endl;
+			return false;
+		}
+		replica = true;
+		thread(&Replication::followPrimary, this, address).detach();
+		return true;
+	}
+
+	// Describes this server's replication state, including how far a replica is behind the primary.
+	// Must be called with the mutex locked.
+	string status() const {
+		if (!replica) {
+			return "Primary at sequence " + to_string(appliedSequence) + ", " + to_string(replicas.size()) + " replicas connected\n";
+		}
+		return "Replica at sequence " + to_string(appliedSequence) + ", lag: " + to_string(headSequence - appliedSequence) + " changes, " + to_string(lagMs) + " ms\n";
+	}
+};
+
 class ServerSocket {
 private:
 	SOCKET serverSocket;
 	SOCKET acceptSocket;
 	sockaddr_in service;
+	Catalog& catalog; // The server's copy of the library which client messages are applied to.
+	Replication& replication; // Sends committed changes to replicas, or marks this server as a read-only replica.
+	bool compression;	// Set when the client asks for large responses to be compressed.
+	string snapshotPath;	// File the catalog is saved to by a "Save snapshot" request.
+	string backendName;	// The backend serving the clients, reported by a "Backend stats" request.
+	unsigned long long requestsHandled;
+	ResultCache resultCache;	// Results of recent queries, shared by every client.
+	vector<CatalogEntry> changedBooks;	// Used by 'invalidateCache', kept so its memory is reused.
+
+	// The last change request each client sent, and the response it was given. A client sends each change with a "Request <client> <number>" line
+	// and sends it again with the same number if it didn't get the response, so a change that was already applied is answered from here instead of applied twice.
+	// Each client waits for a response before sending its next change, so only the last one needs to be kept.
+	struct AppliedRequest {
+		unsigned long long number;
+		string response;
+	};
+	unordered_map<string, AppliedRequest> appliedRequests;
+	deque<string> requestClients;	// Clients in the order they were first seen, so the oldest is forgotten when there are too many.
+	static const size_t maxRequestClients = 4096;
+	size_t asyncClients = 0;	// Clients connected to the event loop backend. Only used on the event loop's thread.
+
+	// Splits a "Request <client> <number>" line off the front of a message. Returns false if the message doesn't start with a valid one.
+	static bool splitRequestId(const string& message, string& client, unsigned long long& number, string& body) {
+		size_t lineEnd = message.find('\n');
+		if (message.rfind("Request ", 0) != 0 || lineEnd == string::npos) {
+			return false;
+		}
+		stringstream header(message.substr(8, lineEnd - 8));
+		string numberText;
+		if (!(header >> client >> numberText) || numberText.find_first_not_of("0123456789") != string::npos || numberText.length() > 19) {
+			return false;
+		}
+		number = strtoull(numberText.c_str(), NULL, 10);
+		body = message.substr(lineEnd + 1);
+		return true;
+	}
+
+	// Returns the CPU time this process has used (user and kernel) in microseconds.
+	static long long processCpuMicroseconds() {
+		FILETIME created, exited, kernel, user;
+		if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user)) {
+			return 0;
+		}
+		// FILETIME counts in 100 nanosecond units, split into two 32-bit halves.
+		unsigned long long kernelTime = ((unsigned long long)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime;
+		unsigned long long userTime = ((unsigned long long)user.dwHighDateTime << 32) | user.dwLowDateTime;
+		return (long long)((kernelTime + userTime) / 10);
+	}
 
 public:
 	// Constructor for binding to a specific IP address
-	ServerSocket(int port, const char* ipAddress) : serverSocket(INVALID_SOCKET), acceptSocket(INVALID_SOCKET) {
+	ServerSocket(int port, const char* ipAddress, Catalog& catalog, Replication& replication) : serverSocket(INVALID_SOCKET), acceptSocket(INVALID_SOCKET), catalog(catalog), replication(replication), compression(false), requestsHandled(0), resultCache(16 * 1024 * 1024) {
 		// Initialise the sockaddr_in structure in the member initialisation list.
 
 		service.sin_family = AF_INET; // Sets the address family to IPv4 structure
@@ -73,7 +1124,7 @@ public:
 
 	// Listens for incoming messages.
 	bool listener() {
-		if (listen(serverSocket, 1) == SOCKET_ERROR) { // Checks if a socket failed to prepare for incomming connections.
+		if (listen(serverSocket, SOMAXCONN) == SOCKET_ERROR) { // Checks if a socket failed to prepare for incomming connections.
 			cout << "listen(): Error listening on socket " << WSAGetLastError() << endl; // Returns latest error.
 			closesocket(serverSocket); // Closes the socket.
 			WSACleanup(); // Releases memory.
@@ -101,43 +1152,241 @@ public:
 
 	// Recieves message from the client.
 	bool recieveMessage(string& message) {
-		// Creates a character array of 200 bytes, with each value being set to 0.
+		// Creates a character array of 4096 bytes (the same as the other backends), with each value being set to 0.
 		// This is to ensure the buffer is cleared before receiving data so it prevents any possible left over data from affecing the recieved message.
-		char buffer[200] = { 0 };
+		char buffer[4096] = { 0 };
 		int byteCount = recv(acceptSocket, buffer, sizeof(buffer), 0); // Receive message from client.
 
 		// If bytecount > 0, then a message was recieved.
 		if (byteCount > 0) {
-			cout << "Message recieved: " << buffer << endl;
 			message = string(buffer, byteCount);
+			cout << "Message recieved: " << message << endl;
 			return true;
 		}
 		cout << "Failed to receive message. Error: " << WSAGetLastError() << endl; // Returns latest error.
 		return false;
 	}
 
+	// Recieves a full request from the client.
+	// Any request can be larger than one 'recv' call (e.g. a change with a long title), so the rest of it is read until it is complete.
+	bool recieveRequest(string& message) {
+		if (!recieveMessage(message)) {
+			return false;
+		}
+		string part;
+		while (!requestComplete(message)) {
+			if (!recieveMessage(part)) {
+				return false;
+			}
+			message += part;
+		}
+		return true;
+	}
+
+	// Returns true once a full request has arrived.
+	// Every request ends with a newline, and a batch request ends with its "Batch end" line. Either may come after a "Request" line.
+	// A request cut short by 'recv' is never processed (or recorded as applied), because it doesn't end with its terminator yet.
+	static bool requestComplete(const string& message) {
+		size_t start = 0;
+		if (message.rfind("Request ", 0) == 0) {
+			start = message.find('\n');
+			if (start == string::npos) {
+				return false;
+			}
+			start++;
+		}
+		const string terminator = message.compare(start, 11, "Batch begin") == 0 ? "Batch end\n" : "\n";
+		return message.length() >= start + terminator.length() && message.compare(message.length() - terminator.length(), terminator.length(), terminator) == 0;
+	}
+
 	// Send a message to the client.
+	// 'send' may not send the whole message at once, so it keeps sending until every byte has been sent.
 	bool sendMessage(const string& message) {
-		int byteCount = send(acceptSocket, message.c_str(), message.length(), 0); // Sends message using the new accepted socket.
-		// If bytecount is the same as the socket error code, the message failed to send.
-		if (byteCount == SOCKET_ERROR) {
-			cout << "\nSending failed: " << WSAGetLastError() << endl; // Returns latest error.
-			return false;
+		size_t sent = 0;
+		while (sent < message.length()) {
+			int byteCount = send(acceptSocket, message.c_str() + sent, message.length() - sent, 0); // Sends message using the new accepted socket.
+			// If bytecount is the same as the socket error code, the message failed to send.
+			if (byteCount == SOCKET_ERROR) {
+				cout << "\nSending failed: " << WSAGetLastError() << endl; // Returns latest error.
+				return false;
+			}
+			sent += byteCount;
 		}
-		cout << "Message sent: " << message << endl;
+		// Compressed data isn't readable, so only its header line is shown.
+		cout << "Message sent: " << (message.rfind("Compressed ", 0) == 0 ? message.substr(0, message.find('\n')) : message) << endl;
 		return true;
 	}
 
+	void setSnapshotPath(const string& path) {
+		snapshotPath = path;
+	}
+
+	void setCacheCapacity(size_t bytes) {
+		resultCache.setCapacity(bytes);
+	}
+
+	void setBackendName(const string& name) {
+		backendName = name;
+	}
+
+	// The listening socket, used by backends that accept connections themselves.
+	SOCKET getListenSocket() const {
+		return serverSocket;
+	}
+
 	// Method used to process recieved message.
 	void handleMessage(const string& message) {
+		sendMessage(processMessage(message, compression)); // Send message back to client.
+	}
+
+	// Turns a query request into the key its result is cached under, or returns an empty string if the message isn't a query.
+	// The request words are matched in any case. A title or author is normalised the same way the catalog matches it (see 'TextMatch'),
+	// so "find TITLE:  dune " and "Find title: Dune" share a result.
+	//   "Find title: <title>" -> "title\t<title key>"     "Find author: <author>" -> "author\t<author key>"
+	//   "List type: <type>"   -> "type\t<type>"       "List books"            -> "all"
+	static string normalizeQuery(const string& message) {
+		static const pair<const char*, const char*> queries[] = { { "find title:", "title" }, { "find author:", "author" }, { "list type:", "type" }, { "list books", "all" } };
+		string lower = message.substr(0, 12);
+		transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return (char)tolower(c); });
+		for (const auto& query : queries) {
+			size_t length = strlen(query.first);
+			if (lower.compare(0, length, query.first) != 0) {
+				continue;
+			}
+			if (string(query.second) == "all") {
+				return "all";
+			}
+			size_t start = message.find_first_not_of(" \t\r\n", length);
+			size_t end = message.find_last_not_of(" \t\r\n");
+			string value = start == string::npos ? "" : message.substr(start, end - start + 1);
+			return string(query.second) + "\t" + (string(query.second) == "type" ? value : TextMatch::normalise(value));
+		}
+		return "";
+	}
+
+	// Works out the response to a query from the catalog. 'query' is a key from 'normalizeQuery'.
+	string answerQuery(const string& query) {
+		size_t tab = query.find('\t');
+		string kind = query.substr(0, tab);
+		string value = (tab == string::npos) ? "" : query.substr(tab + 1);
+		if (kind == "title") {
+			const CatalogEntry* entry = catalog.findByTitle(value);
+			return entry ? "Found " + entry->type + " book titled: " + entry->title + ", author: " + entry->author + "\n" : "No book with that title...\n";
+		}
+		// Lists every matching book, one per line, so a client can merge the listings of several servers.
+		if (kind == "author") {
+			return catalog.serializeMatching("", value) + "List end\n";
+		}
+		if (kind == "type") {
+			return catalog.serializeMatching(value, "") + "List end\n";
+		}
+		return catalog.serialize() + "List end\n";
+	}
+
+	// Removes the cached results that the catalog changes since the last request could have changed.
+	// A changed book can only appear in the results for its title, its author, its type and the full listing, so only those are removed.
+	void invalidateCache() {
+		if (catalog.takeChanges(changedBooks)) {
+			resultCache.clear();
+			return;
+		}
+		if (changedBooks.empty()) {
+			return;
+		}
+		resultCache.invalidate("all");
+		for (const CatalogEntry& book : changedBooks) {
+			resultCache.invalidate("title\t" + book.titleKey);
+			resultCache.invalidate("author\t" + book.authorKey);
+			resultCache.invalidate("type\t" + book.type);
+		}
+	}
+
+	// Method used to work out the response to a recieved message.
+	// 'compression' is the connection's compression setting, which the client can turn on with a "Compression LZ" request.
+	// A change can be sent after a "Request <client> <number>" line, in which case a repeat of the same request gets the first response again (see 'appliedRequests').
+	string processMessage(const string& framedRequest, bool& compression) {
+		MemoryScope scope(MemoryTag::Network); // Request and response buffers. The catalog and the change log tag their own memory.
+		string request = framedRequest.substr(0, framedRequest.length() - 1); // Removes the newline that ends every request.
 		string response;
+		string requestClient, requestBody;
+		unsigned long long requestNumber = 0;
+		bool hasRequestId = splitRequestId(request, requestClient, requestNumber, requestBody);
+		const string& message = hasRequestId ? requestBody : request;
 		vector<string> keyWords = parseMessage(message); // Splits the message into individual words and stores them in a vector.
 
-		if (keyWords.size() > 0) { // Checking if the message received is not empty.
+		// The catalog is shared with the replication thread so it is locked while the request is handled.
+		unique_lock<mutex> guard(replication.getMutex());
+		requestsHandled++;
+		auto applied = hasRequestId ? appliedRequests.find(requestClient) : appliedRequests.end();
+		bool repeated = applied != appliedRequests.end() && applied->second.number == requestNumber;
+
+		// Changes made since the last request (including by the replication thread) are removed from the result cache before it is used.
+		invalidateCache();
+		string query = normalizeQuery(message);
+
+		// A change the client sent again because it didn't get the response is not applied a second time.
+		if (repeated) {
+			response = applied->second.response;
+		}
+		// Read-only requests are answered by both primary and replica servers.
+		else if (keyWords.size() > 0 && keyWords[0] == "Status") {
+			response = replication.status();
+		}
+		// Reports the Bloom filter's size and how many title lookups it rejected, so the false positive rate can be checked against the configured one.
+		else if (message.rfind("Filter stats", 0) == 0) {
+			response = catalog.filterStats();
+		}
+		else if (message.rfind("Cache stats", 0) == 0) {
+			response = resultCache.stats();
+		}
+		// Reports the backend, how many requests it has handled and the CPU time the server has used, so a load test can work out the CPU used per request.
+		else if (message.rfind("Backend stats", 0) == 0) {
+			response = "Backend " + backendName + ": " + to_string(requestsHandled) + " requests, " + to_string(processCpuMicroseconds()) + " us CPU\n";
+		}
+		// The client asks for compression once after connecting. From then on large responses are sent compressed.
+		else if (message.rfind("Compression LZ", 0) == 0) {
+			compression = true;
+			response = "Compression LZ on\n";
+		}
+		// Reports how much memory the server is using for each part of the program, followed by a snapshot of the heap.
+		else if (message.rfind("Memory stats", 0) == 0) {
+			response = MemoryTracker::report() + MemoryTracker::heapSnapshot() + "Memory end\n";
+		}
+		else if (message.rfind("Save snapshot", 0) == 0) {
+			bool saved = catalog.saveSnapshot(snapshotPath, replication.getGeneration(), replication.getSequence());
+			response = saved ? "Snapshot saved to " + snapshotPath + "\n" : "Failed to save snapshot...\n";
+		}
+		// Queries are answered from the result cache if they can be, otherwise the result is worked out and cached.
+		else if (!query.empty()) {
+			const string* cached = resultCache.find(query);
+			if (cached) {
+				response = *cached;
+			}
+			else {
+				response = answerQuery(query);
+				resultCache.insert(query, response);
+			}
+		}
+		// Changes can only be made on the primary server.
+		else if (replication.isReplica()) {
+			response = "Replica is read-only, send changes to the primary server...\n";
+		}
+		else if (keyWords.size() > 0 && keyWords[0] == "Batch") {
+			response = handleBatch(message);
+		}
+		else if (keyWords.size() > 2) { // Checking if the message received has enough words to be a request.
 			// In the admin menu, the user is able to add a new book, delete a book and modify both the book title and author.
-			// These if statements catch the key words received from the client message to simulate the database being updated.
-			// It then sets the response to a string to then be sent back to the client as an appropriate message to simulat the database being updated.
-			if (keyWords[0] == "Deleted") {
+			// These if statements catch the key words received from the client message and apply the change to the server's catalog.
+			// It then sets the response to a string to then be sent back to the client as an appropriate message.
+			string status = catalog.apply(message);
+			if (status == "OK") {
+				replication.record({ message }); // Send the change to any replicas.
+			}
+
+			if (status != "OK") {
+				response = "Server could not apply change: " + status + "\n";
+			}
+			else if (keyWords[0] == "Deleted") {
 				response = "Server deleted book from library...\n";
 			}
 			else if (keyWords[1] == "Online" || keyWords[1] == "Physical") {
@@ -153,9 +1402,102 @@ public:
 				response = "Invalid message...";
 			}
 		}
+		else {
+			response = "Invalid message...";
+		}
+		if (hasRequestId && !repeated) {
+			if (applied == appliedRequests.end()) {
+				if (requestClients.size() >= maxRequestClients) {
+					appliedRequests.erase(requestClients.front());
+					requestClients.pop_front();
+				}
+				requestClients.push_back(requestClient);
+				applied = appliedRequests.insert({ requestClient, AppliedRequest() }).first;
+			}
+			applied->second = { requestNumber, response };
+		}
+		guard.unlock();
+
+		// Large responses are sent as a "Compressed <size>" line followed by the compressed data.
+		if (compression && response.length() > 1024) {
+			string compressed = BlockCompressor::compress(response);
+			response = "Compressed " + to_string(compressed.length()) + "\n" + compressed;
+		}
+		return response;
+	}
+
+	// Coroutine version of 'acceptConnection'. Clients are accepted without blocking and each one is handled by its own coroutine on the event loop,
+	// so many clients can be connected at once on a single thread.
+	// The event loop can only wait on FD_SETSIZE sockets, one of which is the listening socket, so a client past that is closed straight away.
+	Task<void> acceptConnectionsAsync(EventLoop& loop) {
+		AsyncSocket listenSocket(loop, serverSocket);
+		while (true) {
+			SOCKET clientSocket;
+			if (co_await listenSocket.accept(clientSocket) != IoStatus::Ok) {
+				cout << "accept failed: " << WSAGetLastError() << endl; // Returns latest error.
+				co_return;
+			}
+			if (asyncClients >= (size_t)FD_SETSIZE - 1) {
+				cout << "Too many clients, closing the new connection..." << endl;
+				closesocket(clientSocket);
+				continue;
+			}
+			loop.spawn(handleClientAsync(loop, clientSocket));
+		}
+	}
+
+	// Handles one client's requests until it disconnects, or sends nothing for 'idleTimeoutMs'.
+	// Each client has its own compression setting.
+	Task<void> handleClientAsync(EventLoop& loop, SOCKET clientSocket, long idleTimeoutMs = 300000) {
+		asyncClients++;
+		AsyncSocket client(loop, clientSocket);
+		bool clientCompression = false;
+		string message, part;
+		while (co_await client.recv(part, idleTimeoutMs) == IoStatus::Ok) {
+			message += part;
+			if (!requestComplete(message)) {
+				continue;
+			}
+			string response = processMessage(message, clientCompression);
+			message.clear();
+			if (co_await client.send(response, idleTimeoutMs) != IoStatus::Ok) {
+				break;
+			}
+		}
+		closesocket(clientSocket);
+		asyncClients--;
+	}
+
+	// Method used to process a batch of changes sent in one request.
+	// The request is a "Batch begin <count>" line, one client message per line, then a "Batch end" line.
+	// The catalog applies the batch all or nothing, and a committed batch is recorded as one entry in the change log.
+	// The response has one status line per change so the client can see which changes failed.
+	string handleBatch(const string& message) {
+		vector<string> lines;
+		stringstream ss(message);
+		string line;
+		while (getline(ss, line)) {
+			if (line.rfind("Batch ", 0) != 0 && !line.empty()) {
+				lines.push_back(line);
+			}
+		}
+
+		vector<string> statuses;
+		size_t failed = catalog.applyBatch(lines, statuses);
 
-		sendMessage(response); // Send message back to client.
-			
+		string response;
+		if (failed == 0) {
+			replication.record(lines);
+			response = "Batch committed: " + to_string(lines.size()) + " changes\n";
+		}
+		else {
+			response = "Batch rejected: " + to_string(failed) + " of " + to_string(lines.size()) + " changes failed\n";
+		}
+		for (size_t i = 0; i < statuses.size(); i++) {
+			response += to_string(i + 1) + " " + statuses[i] + "\n";
+		}
+		response += "Batch end\n";
+		return response;
 	}
 
 	// Method to separate a message recieved into individual keywords and store them in a vector.
@@ -184,19 +1526,559 @@ public:
 	}
 };
 
+// A server backend is the way the server waits for clients and their requests.
+// Every backend handles requests the same way ('ServerSocket::processMessage'), only the socket calls differ, so the backend can be picked when the server is started.
+class ServerBackend {
+public:
+	virtual ~ServerBackend() {}
+
+	virtual const char* name() const = 0;
+
+	// Serves clients on the server's listening socket. Returns false if the backend could not start.
+	virtual bool run(ServerSocket& server) = 0;
+};
+
+// The original backend: one client at a time with blocking calls. It is the simplest and works everywhere, so it is the default.
+class BlockingBackend : public ServerBackend {
+public:
+	const char* name() const override {
+		return "blocking";
+	}
+
+	bool run(ServerSocket& server) override {
+		// Wait for connection from the client.
+		if (!server.acceptConnection())
+			return false;
+
+		string message;
+
+		// Constantly listen for incoming messages.
+		while (true) {
+			if (!server.recieveRequest(message)) {
+				cout << "\nLost connection..." << endl;
+				break;
+			}
+
+			server.handleMessage(message); // Handle incoming messages.
+
+		}
+		return true;
+	}
+};
+
+// Serves any number of clients at once on one thread with the coroutine event loop, which waits for sockets to be ready using 'select'.
+class SelectBackend : public ServerBackend {
+public:
+	const char* name() const override {
+		return "select";
+	}
+
+	bool run(ServerSocket& server) override {
+		EventLoop loop;
+		loop.spawn(server.acceptConnectionsAsync(loop));
+		loop.run();
+		return true;
+	}
+};
+
+// Serves any number of clients at once on one thread with an I/O completion port, Windows' completion based socket API.
+// With 'select' the server waits until a socket is ready and then makes the call, which is two system calls per step and a scan of every socket each time.
+// With a completion port the call is started straight away with a buffer, and the port reports when it has finished:
+//  - Several 'AcceptEx' calls are kept waiting, and each is started again as soon as it completes, so a new client never waits for an accept to be started.
+//    An accept that can't be started again (e.g. no sockets are left for a moment) is retried every 'acceptRetryMs', so the waiting accepts don't run out.
+//  - Every connection receives into its own fixed slice of one buffer pool that is allocated when the backend starts, so nothing is allocated per receive.
+//  - 'GetQueuedCompletionStatusEx' collects up to 'maxCompletions' finished operations in one call.
+// Each connection has at most one receive or send in progress, so a connection can be closed as soon as one of its operations fails.
+class CompletionPortBackend : public ServerBackend {
+private:
+	static const int acceptsPosted = 16;
+	static const int maxConnections = 4096;
+	static const int bufferSize = 4096;
+	static const int maxCompletions = 64;
+	static const DWORD acceptRetryMs = 100;
+	static const DWORD addressSize = sizeof(sockaddr_in) + 16; // 'AcceptEx' needs 16 bytes more than the address for each address.
+
+	enum class Operation { Accept, Recv, Send };
+
+	struct Connection;
+
+	// The state of one operation. The OVERLAPPED structure is the first member, so the pointer the completion port returns also points to the context.
+	struct IoContext {
+		OVERLAPPED overlapped;
+		Operation operation;
+		Connection* connection;
+		SOCKET acceptSocket;			// Accept only: the socket the next client is accepted on.
+		char addresses[2 * addressSize];	// Accept only: where 'AcceptEx' writes the local and remote addresses.
+	};
+
+	struct Connection {
+		SOCKET socket;
+		IoContext recvContext;
+		IoContext sendContext;
+		char* buffer;		// This connection's slice of the buffer pool.
+		string request;
+		string response;
+		size_t sent;
+		bool compression;	// Each client has its own compression setting.
+	};
+
+	ServerSocket* server = nullptr;
+	SOCKET listenSocket = INVALID_SOCKET;
+	HANDLE completionPort = NULL;
+	LPFN_ACCEPTEX acceptEx = nullptr;
+	IoContext acceptContexts[acceptsPosted];
+	vector<IoContext*> idleAccepts;	// Accept contexts whose 'AcceptEx' couldn't be started, waiting to be retried.
+	vector<char> bufferPool;
+	vector<char*> freeBuffers;
+
+	bool postAccept(IoContext& context) {
+		memset(&context.overlapped, 0, sizeof(context.overlapped));
+		context.operation = Operation::Accept;
+		context.connection = nullptr;
+		context.acceptSocket = WSASocket(AF_INET, SOCK_STREAM, IPPROTO_TCP, NULL, 0, WSA_FLAG_OVERLAPPED);
+		if (context.acceptSocket == INVALID_SOCKET) {
+			return false;
+		}
+		DWORD bytes = 0;
+		if (!acceptEx(listenSocket, context.acceptSocket, context.addresses, 0, addressSize, addressSize, &bytes, &context.overlapped) && WSAGetLastError() != ERROR_IO_PENDING) {
+			closesocket(context.acceptSocket);
+			return false;
+		}
+		return true;
+	}
+
+	bool postRecv(Connection* connection) {
+		memset(&connection->recvContext.overlapped, 0, sizeof(OVERLAPPED));
+		WSABUF buffer = { (ULONG)bufferSize, connection->buffer };
+		DWORD flags = 0;
+		return WSARecv(connection->socket, &buffer, 1, NULL, &flags, &connection->recvContext.overlapped, NULL) == 0 || WSAGetLastError() == WSA_IO_PENDING;
+	}
+
+	bool postSend(Connection* connection) {
+		memset(&connection->sendContext.overlapped, 0, sizeof(OVERLAPPED));
+		WSABUF buffer = { (ULONG)(connection->response.length() - connection->sent), &connection->response[connection->sent] };
+		return WSASend(connection->socket, &buffer, 1, NULL, 0, &connection->sendContext.overlapped, NULL) == 0 || WSAGetLastError() == WSA_IO_PENDING;
+	}
+
+	void closeConnection(Connection* connection) {
+		closesocket(connection->socket);
+		freeBuffers.push_back(connection->buffer);
+		delete connection;
+	}
+
+	void onAccept(IoContext& context, bool ok) {
+		SOCKET clientSocket = context.acceptSocket;
+		// The next accept is started before this client is set up, so there are always accepts waiting.
+		if (!postAccept(context)) {
+			cout << "AcceptEx failed: " << WSAGetLastError() << ", retrying..." << endl;
+			idleAccepts.push_back(&context);
+		}
+		if (!ok) {
+			closesocket(clientSocket);
+			return;
+		}
+		if (freeBuffers.empty()) {
+			cout << "Too many clients, closing the new connection..." << endl;
+			closesocket(clientSocket);
+			return;
+		}
+		// The accepted socket takes its settings from the listening socket.
+		setsockopt(clientSocket, SOL_SOCKET, SO_UPDATE_ACCEPT_CONTEXT, (char*)&listenSocket, sizeof(listenSocket));
+
+		Connection* connection = new Connection();
+		connection->socket = clientSocket;
+		connection->recvContext.operation = Operation::Recv;
+		connection->recvContext.connection = connection;
+		connection->sendContext.operation = Operation::Send;
+		connection->sendContext.connection = connection;
+		connection->buffer = freeBuffers.back();
+		freeBuffers.pop_back();
+		connection->sent = 0;
+		connection->compression = false;
+		if (CreateIoCompletionPort((HANDLE)clientSocket, completionPort, 0, 0) == NULL || !postRecv(connection)) {
+			closeConnection(connection);
+		}
+	}
+
+	void onRecv(Connection* connection, DWORD bytes, bool ok) {
+		// A receive of 0 bytes means the client disconnected.
+		if (!ok || bytes == 0) {
+			closeConnection(connection);
+			return;
+		}
+		connection->request.append(connection->buffer, bytes);
+		if (!ServerSocket::requestComplete(connection->request)) {
+			if (!postRecv(connection)) {
+				closeConnection(connection);
+			}
+			return;
+		}
+		connection->response = server->processMessage(connection->request, connection->compression);
+		connection->request.clear();
+		connection->sent = 0;
+		if (!postSend(connection)) {
+			closeConnection(connection);
+		}
+	}
+
+	void onSend(Connection* connection, DWORD bytes, bool ok) {
+		if (!ok) {
+			closeConnection(connection);
+			return;
+		}
+		// A send can finish early, so the rest of the response is sent before waiting for the next request.
+		connection->sent += bytes;
+		bool posted = connection->sent < connection->response.length() ? postSend(connection) : postRecv(connection);
+		if (!posted) {
+			closeConnection(connection);
+		}
+	}
+
+public:
+	const char* name() const override {
+		return "iocp";
+	}
+
+	bool run(ServerSocket& server) override {
+		this->server = &server;
+		listenSocket = server.getListenSocket();
+		completionPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+		if (completionPort == NULL || CreateIoCompletionPort((HANDLE)listenSocket, completionPort, 0, 0) == NULL) {
+			cout << "CreateIoCompletionPort failed: " << GetLastError() << endl;
+			return false;
+		}
+
+		// 'AcceptEx' is an extension function, so its address has to be looked up through the socket.
+		GUID acceptExGuid = WSAID_ACCEPTEX;
+		DWORD bytes = 0;
+		if (WSAIoctl(listenSocket, SIO_GET_EXTENSION_FUNCTION_POINTER, &acceptExGuid, sizeof(acceptExGuid), &acceptEx, sizeof(acceptEx), &bytes, NULL, NULL) == SOCKET_ERROR) {
+			cout << "Failed to find AcceptEx: " << WSAGetLastError() << endl;
+			return false;
+		}
+
+		bufferPool.resize((size_t)maxConnections * bufferSize);
+		for (int i = maxConnections - 1; i >= 0; i--) {
+			freeBuffers.push_back(&bufferPool[(size_t)i * bufferSize]);
+		}
+		for (IoContext& context : acceptContexts) {
+			if (!postAccept(context)) {
+				cout << "AcceptEx failed: " << WSAGetLastError() << endl;
+				return false;
+			}
+		}
+
+		OVERLAPPED_ENTRY entries[maxCompletions];
+		while (true) {
+			// Accepts that couldn't be started are retried, and while any are left the wait times out so they are retried again.
+			for (auto it = idleAccepts.begin(); it != idleAccepts.end();) {
+				it = postAccept(**it) ? idleAccepts.erase(it) : it + 1;
+			}
+			ULONG count = 0;
+			if (!GetQueuedCompletionStatusEx(completionPort, entries, maxCompletions, &count, idleAccepts.empty() ? INFINITE : acceptRetryMs, FALSE)) {
+				if (GetLastError() == WAIT_TIMEOUT) {
+					continue;
+				}
+				cout << "GetQueuedCompletionStatusEx failed: " << GetLastError() << endl;
+				return false;
+			}
+			for (ULONG i = 0; i < count; i++) {
+				IoContext* context = (IoContext*)entries[i].lpOverlapped;
+				// 'Internal' holds the status of the finished operation, which is 0 if it succeeded.
+				bool ok = entries[i].lpOverlapped->Internal == 0;
+				DWORD transferred = entries[i].dwNumberOfBytesTransferred;
+				if (context->operation == Operation::Accept) {
+					onAccept(*context, ok);
+				}
+				else if (context->operation == Operation::Recv) {
+					onRecv(context->connection, transferred, ok);
+				}
+				else {
+					onSend(context->connection, transferred, ok);
+				}
+			}
+		}
+	}
+};
+
+// Measures a running server's requests per second, latency and CPU time per request, to compare the backends and the result cache.
+// 'connections' clients each send 'requests' read-only requests ('message') one after another, each on its own thread.
+// The server's "Backend stats" are read before and after on the first connection, so the CPU time only covers the test.
+// The blocking backend serves one client at a time, so test it with one connection.
+void loadTest(int port, int connections, int requests, const string& message) {
+	WSADATA wsaData;
+	WSAStartup(MAKEWORD(2, 2), &wsaData);
+	sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	InetPtonA(AF_INET, "127.0.0.1", &address.sin_addr.s_addr);
+
+	vector<SOCKET> sockets;
+	for (int i = 0; i < connections; i++) {
+		SOCKET clientSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (clientSocket == INVALID_SOCKET || connect(clientSocket, (SOCKADDR*)&address, sizeof(address)) == SOCKET_ERROR) {
+			cout << "Load test: failed to connect: " << WSAGetLastError() << endl;
+			return;
+		}
+		sockets.push_back(clientSocket);
+	}
+
+	// Sends one request and reads its reply. Listings end with a "List end" line and every other reply is a single line.
+	auto request = [](SOCKET clientSocket, const string& message, string& reply) {
+		reply.clear();
+		if (send(clientSocket, message.c_str(), (int)message.length(), 0) != (int)message.length()) {
+			return false;
+		}
+		const string terminator = (message.rfind("List", 0) == 0 || message.rfind("Find author", 0) == 0) ? "List end\n" : "\n";
+		char buffer[4096];
+		while (reply.length() < terminator.length() || reply.compare(reply.length() - terminator.length(), terminator.length(), terminator) != 0) {
+			int byteCount = recv(clientSocket, buffer, sizeof(buffer), 0);
+			if (byteCount <= 0) {
+				return false;
+			}
+			reply.append(buffer, byteCount);
+		}
+		return true;
+	};
+
+	// Reads the request count and CPU time from a "Backend <name>: <requests> requests, <cpu> us CPU" reply.
+	auto readStats = [&request](SOCKET clientSocket, string& backend, long long& handled, long long& cpu) {
+		string reply, word;
+		if (!request(clientSocket, "Backend stats", reply)) {
+			return false;
+		}
+		stringstream ss(reply);
+		ss >> word >> backend >> handled >> word >> cpu;
+		backend.pop_back(); // Remove the ':'
+		return true;
+	};
+
+	string backend;
+	long long handledBefore = 0, cpuBefore = 0, handledAfter = 0, cpuAfter = 0;
+	if (!readStats(sockets[0], backend, handledBefore, cpuBefore)) {
+		cout << "Load test: the server did not answer" << endl;
+		return;
+	}
+
+	// Each thread records how long each of its requests took, in microseconds.
+	vector<vector<long long>> latencies(connections);
+	auto start = chrono::steady_clock::now();
+	vector<thread> threads;
+	for (int i = 0; i < connections; i++) {
+		threads.emplace_back([&, i]() {
+			string reply;
+			for (int r = 0; r < requests; r++) {
+				auto sent = chrono::steady_clock::now();
+				if (!request(sockets[i], message, reply)) {
+					break;
+				}
+				latencies[i].push_back(chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - sent).count());
+			}
+		});
+	}
+	for (thread& t : threads) {
+		t.join();
+	}
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	readStats(sockets[0], backend, handledAfter, cpuAfter);
+	for (SOCKET clientSocket : sockets) {
+		closesocket(clientSocket);
+	}
+	WSACleanup();
+
+	vector<long long> all;
+	for (const vector<long long>& threadLatencies : latencies) {
+		all.insert(all.end(), threadLatencies.begin(), threadLatencies.end());
+	}
+	if (all.empty()) {
+		cout << "Load test: no requests were answered" << endl;
+		return;
+	}
+	sort(all.begin(), all.end());
+	long long total = (long long)all.size();
+	// The stats request itself is counted by the server, so it is taken off.
+	long long handled = handledAfter - handledBefore - 1;
+	cout << "Backend " << backend << ", " << connections << " connections: " << total << " requests in " << seconds << " s, "
+		<< (long long)(total / seconds) << " requests/s, " << (handled > 0 ? (double)(cpuAfter - cpuBefore) / handled : 0) << " us server CPU per request" << endl;
+	cout << "Latency: p50 " << all[all.size() / 2] << " us, p99 " << all[all.size() * 99 / 100] << " us, max " << all.back() << " us" << endl;
+}
+
+// Measures how fast 'BlockCompressor' compresses and decompresses a synthetic catalog listing and how much smaller it makes it.
+// The catalog is generated and measured in chunks of 100,000 books so a 10 million book catalog doesn't need to be held in memory at once.
+void benchmarkCompression(size_t books) {
+	const char* firstNames[] = { "Emma", "Liam", "Dylan", "James", "Grace", "Ava", "Nora", "Oliver", "Harper", "Sebastian", "Jasper", "Mason", "Leo", "Clara", "Henry", "Lena" };
+	const char* lastNames[] = { "Blackwood", "Hunter", "Cooper", "Whitmore", "Bennett", "Montgomery", "Stevens", "Gray", "Wilson", "Cole", "Ford", "White", "Knight", "Mills", "Wright", "Murphy" };
+	const char* words[] = { "Silent", "Echo", "Whispers", "Dark", "Last", "Embrace", "Forgotten", "Path", "Shadows", "Lost", "Hidden", "Garden", "Burning", "Sky", "Stars", "Storm" };
+	const char* letters = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+	const size_t chunkBooks = 100000;
+
+	unsigned int seed = 12345;
+	auto next = [&seed]() {
+		seed = seed * 1103515245u + 12345u;
+		return (seed >> 8);
+	};
+
+	size_t rawBytes = 0, compressedBytes = 0;
+	double compressSeconds = 0, decompressSeconds = 0;
+	for (size_t done = 0; done < books; done += chunkBooks) {
+		string listing;
+		for (size_t i = done; i < books && i < done + chunkBooks; i++) {
+			string author = string(firstNames[next() % 16]) + " " + lastNames[next() % 16];
+			string title = string("The ") + words[next() % 16] + " " + words[next() % 16] + " " + to_string(i);
+			if (i % 2 == 0) {
+				listing += "Physical\t" + title + "\t" + author + "\t" + to_string(next() % 250) + "\n";
+			}
+			else {
+				string url = "www.myOnlineBook/index/";
+				for (int c = 0; c < 8; c++) {
+					url += letters[next() % 62];
+				}
+				listing += "Online\t" + title + "\t" + author + "\t" + url + "\n";
+			}
+		}
+
+		auto start = chrono::steady_clock::now();
+		string compressed = BlockCompressor::compress(listing);
+		auto middle = chrono::steady_clock::now();
+		string decompressed;
+		bool ok = BlockCompressor::decompress(compressed, decompressed);
+		auto end = chrono::steady_clock::now();
+		if (!ok || decompressed != listing) {
+			cout << "Benchmark failed: decompressed data does not match" << endl;
+			return;
+		}
+
+		rawBytes += listing.length();
+		compressedBytes += compressed.length();
+		compressSeconds += chrono::duration<double>(middle - start).count();
+		decompressSeconds += chrono::duration<double>(end - middle).count();
+	}
+
+	double megabytes = rawBytes / (1024.0 * 1024.0);
+	cout << "Books: " << books << ", raw size: " << megabytes << " MB, compressed size: " << compressedBytes / (1024.0 * 1024.0) << " MB" << endl;
+	cout << "Ratio: " << (double)rawBytes / compressedBytes << endl;
+	cout << "Compression: " << megabytes / compressSeconds << " MB/s" << endl;
+	cout << "Decompression: " << megabytes / decompressSeconds << " MB/s" << endl;
+}
+
 // Main Program
+// Run with no arguments, or "primary <port> <replication port>", to start a primary server.
+// Run with "replica <port> <primary replication port>" to start a read-only replica that follows a primary on the same machine.
+// Run with "benchmark [books]" to measure compression on a synthetic catalog (10 million books by default).
+// Add "async" (or "select") to serve any number of clients at once on a coroutine event loop instead of a single blocking client,
+// or "iocp" to serve them with an I/O completion port.
+// Add "bloom <rate>" to set the false positive rate of the catalog's title filter (0.01 by default).
+// Add "cache <MB>" to set the size of the query result cache (16 MB by default, 0 turns it off).
+// Run with "loadtest <port> [connections] [requests] [request]" to measure the requests per second, latency and CPU per request of a server that is already running.
 int main(int argc, char* argv[]) {
 
+	if (argc >= 2 && string(argv[1]) == "benchmark") {
+		benchmarkCompression(argc >= 3 ? strtoull(argv[2], NULL, 10) : 10000000);
+		return 0;
+	}
+	if (argc >= 3 && string(argv[1]) == "loadtest") {
+		loadTest(atoi(argv[2]), argc >= 4 ? atoi(argv[3]) : 64, argc >= 5 ? atoi(argv[4]) : 10000, argc >= 6 ? argv[5] : "Find title: The Silent Echo");
+		return 0;
+	}
+
 	const char* ipAddress = "127.0.0.1"; // Set IP (local)
 	int port = 55555;					 // Set port (local)
+	int replicationPort = 0;			 // Port the primary sends its change log to replicas on, see below
+	bool replica = false;
+	BlockingBackend blockingBackend;
+	SelectBackend selectBackend;
+	CompletionPortBackend completionPortBackend;
+	ServerBackend* backend = &blockingBackend;
+	double falsePositiveRate = 0.01;
+	int cacheMegabytes = 16;
+
+	// The first number given is the port and the second is the replication port.
+	int numbers = 0;
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		if (arg == "replica") {
+			replica = true;
+		}
+		else if (arg == "async" || arg == "select") {
+			backend = &selectBackend;
+		}
+		else if (arg == "iocp") {
+			backend = &completionPortBackend;
+		}
+		else if (arg == "bloom" && i + 1 < argc) {
+			falsePositiveRate = atof(argv[++i]);
+		}
+		else if (arg == "cache" && i + 1 < argc) {
+			cacheMegabytes = atoi(argv[++i]);
+		}
+		else if (arg != "primary") {
+			(numbers++ == 0 ? port : replicationPort) = atoi(argv[i]);
+		}
+	}
+	// A primary's replication port defaults to 1000 above its port (or below, near the top of the range), so several shards can run on one host
+	// with just their ports. A replica has to be told the primary's replication port, as it can't work it out from its own port.
+	if (replicationPort == 0) {
+		if (replica) {
+			cout << "A replica needs the primary's replication port: replica <port> <replication port>" << endl;
+			return 0;
+		}
+		replicationPort = port + 1000 <= 65535 ? port + 1000 : port - 1000;
+	}
+
+	// The server's copy of the library starts with the same books the client adds on startup.
+	Catalog catalog;
+	if (falsePositiveRate <= 0 || falsePositiveRate >= 1) {
+		cout << "The Bloom filter false positive rate must be between 0 and 1." << endl;
+		return 0;
+	}
+	catalog.setFalsePositiveRate(falsePositiveRate);
+	catalog.addEntry("Physical", "The Silent Echo", "Emma Blackwood");
+	catalog.addEntry("Physical", "Whispers in the Dark", "Liam Hunter");
+	catalog.addEntry("Physical", "The Last Embrace", "Dylan Cooper");
+	catalog.addEntry("Physical", "The Forgotten Path", "James Whitmore");
+	catalog.addEntry("Physical", "Shadows of the Lost", "Grace Bennett");
+	catalog.addEntry("Physical", "The Hidden Garden", "Ava Montgomery");
+	catalog.addEntry("Physical", "Fragments of the Past", "Nora Stevens");
+	catalog.addEntry("Physical", "The Burning Sky", "Oliver Gray");
+	catalog.addEntry("Physical", "Dance of the Stars", "Harper Wilson");
+	catalog.addEntry("Physical", "Shattered Glass", "Sebastian Cole");
+	catalog.addEntry("Physical", "Between Worlds", "Jasper Ford");
+	catalog.addEntry("Physical", "The Heart of the Storm", "Mason White");
+	catalog.addEntry("Physical", "A Symphony of Souls", "Leo Knight");
+
+	catalog.addEntry("Online", "The Shadow's Edge", "Clara Mills");
+	catalog.addEntry("Online", "The Forgotten Kingdom", "Henry Wright");
+	catalog.addEntry("Online", "The Depths of Desire", "Lena Murphy");
+	catalog.addEntry("Online", "The Silent Witness", "David Reed");
+	catalog.addEntry("Online", "Requiem for the Lost", "Natalie Stone");
+	catalog.addEntry("Online", "Journey into the Unknown", "Isobel Price");
+	catalog.addEntry("Online", "A World of Dreams", "Mason Hart");
+	catalog.addEntry("Online", "The Edge of Tomorrow", "Ethan Matthews");
+	catalog.addEntry("Online", "Whispers in the Wind", "Benjamin Miles");
+
+	// If the catalog was saved by an earlier run, it replaces the starting books and replication carries on from where the snapshot was saved.
+	// A replica then only asks the primary for the changes made since.
+	string snapshotPath = "catalog" + to_string(port) + ".snap";
+	Replication replication(catalog);
+	unsigned long long savedGeneration, savedSequence;
+	if (catalog.loadSnapshot(snapshotPath, savedGeneration, savedSequence)) {
+		replication.restore(savedGeneration, savedSequence);
+		cout << "Loaded " << catalog.size() << " books from " << snapshotPath << " at sequence " << savedSequence << endl;
+	}
 
 	// Instantiate class object
-	ServerSocket server(port, ipAddress);
+	ServerSocket server(port, ipAddress, catalog, replication);
+	server.setSnapshotPath(snapshotPath);
+	server.setCacheCapacity((size_t)max(cacheMegabytes, 0) * 1024 * 1024);
 
 	// These methods start a server connection, waiting for a client connection.
 	// This method finds the Winsock dll.
 	if (!server.initaliseWinsock())
 		return 0;
+	// A primary starts listening for replicas, a replica starts following the primary.
+	if (replica ? !replication.startReplica(replicationPort, ipAddress) : !replication.startPrimary(replicationPort, ipAddress))
+		return 0;
 	// This method creates a server socket.
 	if (!server.createSocket())
 		return 0;
@@ -206,22 +2088,14 @@ int main(int argc, char* argv[]) {
 	// This method sets up the socket to listen for incoming clients.
 	if (!server.listener())
 		return 0;
-	// Wait for connection from the client.
-	if (!server.acceptConnection())
-		return 0;
 
-	string message;
+	// From here on memory is counted as networking (connections, coroutine frames and buffers), apart from the parts that set their own tag.
+	MemoryScope networkScope(MemoryTag::Network);
 
-	// Constantly listen for incoming messages.
-	while (true) {
-		if (!server.recieveMessage(message)) {
-			cout << "\nLost connection..." << endl;
-			break;
-		}
-
-		server.handleMessage(message); // Handle incoming messages.
-
-	}
+	// The backend serves the clients until the server is closed.
+	cout << "Serving clients with the " << backend->name() << " backend..." << endl;
+	server.setBackendName(backend->name());
+	backend->run(server);
 
 	return 0;
 }
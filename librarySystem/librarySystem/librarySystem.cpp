@@ -4,8 +4,25 @@
 #include "stdafx.h"
 #include <winsock2.h>
 #include <WS2tcpip.h>
+#include <mstcpip.h>
 #include <algorithm> 
 #include <cctype>    
+#include <map>
+#include <sstream>
+#include <fstream>
+#include <variant>
+#include <chrono>
+#include <type_traits>
+#include <thread>
+#include <random>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <shared_mutex>
+#include "../Compression.h"
+#include "../EventLoop.h"
+#include "../MemoryTracker.h"
+#include "../TextMatch.h"
 
 using namespace std;
 
@@ -17,14 +34,17 @@ public:
 	// Each method in the class 'Logger' has the same name but takes in different parameters. This is called overloading. 
 	// It enables the same function to handle different datatypes or arguments.
 	void logMessage(const string& message) {
+		MemoryScope scope(MemoryTag::Logging);
 		cout << "[LOG MESSAGE] " << message << endl;
 	}
 
 	void logMessage(string& message) {
+		MemoryScope scope(MemoryTag::Logging);
 		cout << "[LOG MESSAGE] " << message << endl;
 	}
 
 	void logMessage(int message) {
+		MemoryScope scope(MemoryTag::Logging);
 		cout << "[LOG MESSAGE] " << message << endl;
 	}
 };
@@ -35,21 +55,19 @@ class Book {
 protected:
 	mutable string title;	// Mutable so it can be changed by the Librarian class
 	mutable string author;  // Mutable so it can be changed by the Librarian class
-	static int totalBooks;
+	mutable string titleKey;	// The title and author normalised for searching (see 'TextMatch'), made once here instead of on every search.
+	mutable string authorKey;	// The Librarian class changes them along with the title and author.
 
 public:
 	// Constructor 
-	// Used to initialise objects of the book class. It initialises the 'title' and 'author' attributes, then increments the 'totalBooks' counter so the library has the correct number of total books.
-	Book(const string& title, const string& author) : title(title), author(author) { 
-		++totalBooks; // Increase the static book count by 1
-	}
+	// Used to initialise objects of the book class. It initialises the 'title' and 'author' attributes and their search keys.
+	// The number of books is counted by the library the book is added to (see 'CatalogStats'), not by the book itself.
+	Book(const string& title, const string& author) : title(title), author(author), titleKey(TextMatch::normalise(title)), authorKey(TextMatch::normalise(author)) {}
 
 	// Destructor 
-	// Used to decrement the 'totalBooks' counter and ensure proper exeuction of derived class destructors during cleanup
+	// Used to ensure proper exeuction of derived class destructors during cleanup
 	// The reason this destructor is declared as virtual is to maintain polymorphic behaviour during the object destruction. 
-	virtual ~Book() { 
-		--totalBooks; // Decrease the static book count by 1
-	}
+	virtual ~Book() {}
 
 	// Return book title
 	virtual string getTitle() const {
@@ -61,22 +79,29 @@ public:
 		return author;
 	}
 
+	// Return the normalised title and author. These are returned by reference so a search doesn't copy them.
+	const string& getTitleKey() const {
+		return titleKey;
+	}
+
+	const string& getAuthorKey() const {
+		return authorKey;
+	}
+
 	// Display function using polymorphism
 	virtual void display() const {
 		cout << "Title: " << title << ", Author: " << author << endl;
 	}
 
-	// Static member function for returning 'totalBooks'
-	static int getTotalBooks() {
-		return totalBooks;
+	// Returns the book as one tab separated line, used for machine readable output in script mode.
+	virtual string toRecord() const {
+		return title + "\t" + author;
 	}
 
 	friend class Librarian; // Allows the 'Librarian' class to access protected attributes in 'Book' class.
 
 };
 
-int Book::totalBooks = 0; // Initialize static member
-
 
 // Exception Handling using Exception Classes (Inheriting from Exception) 
 // The class LibraryException inherits from the class exception.
@@ -101,6 +126,11 @@ public:
 	// 'shelfNum' is passed in by value instead of by reference because it is a small data type and copying it is easier.
 	PhysicalBook(const string& title, const string& author, int shelfNum) : Book(title, author), shelfNum(shelfNum) {}
 
+	// Return shelf number
+	int getShelfNum() const {
+		return shelfNum;
+	}
+
 	// Override 
 	// This display function overrides the the virtual display function of the base class 'Book'
 	void display() const override {
@@ -108,6 +138,10 @@ public:
 		cout << "Shelf Number: " << shelfNum << endl;
 	}
 
+	string toRecord() const override {
+		return "Physical\t" + Book::toRecord() + "\t" + to_string(shelfNum);
+	}
+
 };
 
 // Derived class inheriting from the 'Book' class.
@@ -128,6 +162,10 @@ public:
 		cout << "Url: " << url << endl;
 	}
 
+	string toRecord() const override {
+		return "Online\t" + Book::toRecord() + "\t" + url;
+	}
+
 };
 
 // Friendship
@@ -136,15 +174,285 @@ class Librarian {
 public:
 	// These methods are for changing the title and author of the book passed in as a parameter to the new title/author also passed in as a parameter.
 	void modifiyBookTitle(const Book& book, const string& newTitle) {
+		MemoryScope scope(MemoryTag::Catalog);
 		book.title = newTitle; // Accessing private member (friendship)
+		book.titleKey = TextMatch::normalise(newTitle);
 	}
 
 	void modifiyBookAuthor(const Book& book, const string& newAuthor) {
+		MemoryScope scope(MemoryTag::Catalog);
 		book.author = newAuthor; // Accessing private member (friendship)
+		book.authorKey = TextMatch::normalise(newAuthor);
 	}
 
 };
 
+// Describes one change to the library so several changes can be collected and then applied together as a batch.
+// The operation uses the same numbers as the admin menu choices.
+struct BookMutation {
+	char operation;		// '1' add, '2' delete, '3' modify title, '4' modify author
+	char bookType;		// 'p' or 'o', only used when adding a book
+	string target;		// Title (delete, modify title) or author (modify author) of the existing book
+	string title;		// Title of the new book, or the new title
+	string author;		// Author of the new book, or the new author
+	string url;
+	int shelfNum;
+};
+
+// Statistics about the books in a library, kept up to date as books are added, deleted and changed so they can be read without going through every book.
+// Every update is O(1). The counts are kept in hash maps, and the authors are kept in buckets of authors with the same number of books, ordered by that number.
+// When an author's count changes the author moves to the next bucket up or down (the same way an LFU cache keeps its counts), so the top authors are always at the end.
+// Authors are counted by their normalised name (see 'TextMatch'), so "Jane Doe" and "jane  doe" are the same author, the same way the library matches them.
+// Updates take the lock exclusively and reads share it, so the statistics can be read from another thread while the library is being changed.
+class CatalogStats {
+private:
+	struct AuthorBucket {
+		size_t count;
+		list<string> authors;	// Normalised author names.
+	};
+
+	struct AuthorPosition {
+		list<AuthorBucket>::iterator bucket;
+		list<string>::iterator position;
+		string name;	// The author as first written, which is what is shown.
+	};
+
+	mutable shared_mutex statsMutex;
+	size_t totalBooks = 0;
+	size_t physicalBooks = 0;
+	size_t onlineBooks = 0;
+	unordered_map<int, size_t> shelfCounts;
+	unordered_map<size_t, size_t> shelfHistogram;	// Books on each range of 'shelfRange' shelves, only for ranges that have books, so a very large shelf number doesn't need a huge array.
+													// Negative shelf numbers are counted in the first range. The ranges are only sorted when they are read.
+	list<AuthorBucket> authorBuckets;	// Ordered by count, lowest first.
+	unordered_map<string, AuthorPosition> authorPositions;
+
+	// Moves the author into the bucket for one more book, adding the author if this is their first book.
+	void addAuthor(const string& author) {
+		string key = TextMatch::normalise(author);
+		auto found = authorPositions.find(key);
+		list<AuthorBucket>::iterator current = (found == authorPositions.end()) ? authorBuckets.end() : found->second.bucket;
+		size_t count = (found == authorPositions.end()) ? 1 : current->count + 1;
+		list<AuthorBucket>::iterator target = (found == authorPositions.end()) ? authorBuckets.begin() : next(current);
+		if (target == authorBuckets.end() || target->count != count) {
+			target = authorBuckets.insert(target, { count, {} });
+		}
+
+		if (found == authorPositions.end()) {
+			target->authors.push_front(key);
+			authorPositions[key] = { target, target->authors.begin(), author };
+			return;
+		}
+		// Splicing moves the list node, so the author's position stays valid.
+		target->authors.splice(target->authors.begin(), current->authors, found->second.position);
+		found->second.bucket = target;
+		if (current->authors.empty()) {
+			authorBuckets.erase(current);
+		}
+	}
+
+	// Moves the author into the bucket for one less book, removing the author when they have none left.
+	void removeAuthor(const string& author) {
+		auto found = authorPositions.find(TextMatch::normalise(author));
+		if (found == authorPositions.end()) {
+			return;
+		}
+		list<AuthorBucket>::iterator current = found->second.bucket;
+		if (current->count == 1) {
+			current->authors.erase(found->second.position);
+			authorPositions.erase(found);
+		}
+		else {
+			list<AuthorBucket>::iterator target = current;
+			if (current == authorBuckets.begin() || (--target)->count != current->count - 1) {
+				target = authorBuckets.insert(current, { current->count - 1, {} });
+			}
+			target->authors.splice(target->authors.begin(), current->authors, found->second.position);
+			found->second.bucket = target;
+		}
+		if (current->authors.empty()) {
+			authorBuckets.erase(current);
+		}
+	}
+
+	// Used by 'topAuthors' and 'report', which hold the lock.
+	vector<pair<string, size_t>> listTopAuthors(size_t count) const {
+		vector<pair<string, size_t>> top;
+		for (auto bucket = authorBuckets.rbegin(); bucket != authorBuckets.rend() && top.size() < count; ++bucket) {
+			for (auto author = bucket->authors.begin(); author != bucket->authors.end() && top.size() < count; ++author) {
+				top.push_back({ authorPositions.at(*author).name, bucket->count });
+			}
+		}
+		return top;
+	}
+
+	void changeShelf(int shelf, bool added) {
+		size_t range = shelf < 0 ? 0 : (size_t)shelf / shelfRange;
+		if (added) {
+			shelfCounts[shelf]++;
+			shelfHistogram[range]++;
+		}
+		else {
+			if (--shelfCounts[shelf] == 0) {
+				shelfCounts.erase(shelf);
+			}
+			if (--shelfHistogram[range] == 0) {
+				shelfHistogram.erase(range);
+			}
+		}
+	}
+
+	void changeBook(const Book& book, bool added) {
+		unique_lock<shared_mutex> guard(statsMutex);
+		const PhysicalBook* physical = dynamic_cast<const PhysicalBook*>(&book);
+		size_t& typeCount = physical ? physicalBooks : onlineBooks;
+		if (added) {
+			totalBooks++;
+			typeCount++;
+			addAuthor(book.getAuthor());
+		}
+		else {
+			totalBooks--;
+			typeCount--;
+			removeAuthor(book.getAuthor());
+		}
+		if (physical) {
+			changeShelf(physical->getShelfNum(), added);
+		}
+	}
+
+public:
+	static const int shelfRange = 10;
+
+	void bookAdded(const Book& book) {
+		changeBook(book, true);
+	}
+
+	// Must be called before the book is deleted or its author is changed.
+	void bookRemoved(const Book& book) {
+		changeBook(book, false);
+	}
+
+	void authorChanged(const string& previous, const string& author) {
+		unique_lock<shared_mutex> guard(statsMutex);
+		removeAuthor(previous);
+		addAuthor(author);
+	}
+
+	size_t total() const {
+		shared_lock<shared_mutex> guard(statsMutex);
+		return totalBooks;
+	}
+
+	// The type is "PhysicalBook" or "OnlineBook", the same as 'showBookByType'.
+	size_t countByType(const string& type) const {
+		shared_lock<shared_mutex> guard(statsMutex);
+		return type == "PhysicalBook" ? physicalBooks : type == "OnlineBook" ? onlineBooks : 0;
+	}
+
+	size_t countByAuthor(const string& author) const {
+		shared_lock<shared_mutex> guard(statsMutex);
+		auto found = authorPositions.find(TextMatch::normalise(author));
+		return found == authorPositions.end() ? 0 : found->second.bucket->count;
+	}
+
+	size_t countByShelf(int shelf) const {
+		shared_lock<shared_mutex> guard(statsMutex);
+		auto found = shelfCounts.find(shelf);
+		return found == shelfCounts.end() ? 0 : found->second;
+	}
+
+	// Returns up to 'count' authors with the most books, most first. Authors with the same number of books are in no particular order.
+	vector<pair<string, size_t>> topAuthors(size_t count) const {
+		shared_lock<shared_mutex> guard(statsMutex);
+		return listTopAuthors(count);
+	}
+
+	// Returns how many books are on each range of 'shelfRange' shelves (range 0 is shelves 0 to 9), in shelf order. Empty ranges are left out.
+	map<size_t, size_t> shelfOccupancy() const {
+		shared_lock<shared_mutex> guard(statsMutex);
+		return map<size_t, size_t>(shelfHistogram.begin(), shelfHistogram.end());
+	}
+
+	// Returns the statistics as text for the main menu.
+	// Everything is read under one lock, so the numbers all come from the same moment even while the library is being changed.
+	string report(size_t topCount) const {
+		shared_lock<shared_mutex> guard(statsMutex);
+		stringstream text;
+		text << "Total books: " << totalBooks << " (" << physicalBooks << " physical, " << onlineBooks << " online)\n";
+		text << "Top authors:\n";
+		for (const pair<string, size_t>& author : listTopAuthors(topCount)) {
+			text << "  " << author.first << ": " << author.second << "\n";
+		}
+		text << "Shelf occupancy:\n";
+		for (const pair<const size_t, size_t>& range : map<size_t, size_t>(shelfHistogram.begin(), shelfHistogram.end())) {
+			text << "  Shelves " << range.first * shelfRange << "-" << range.first * shelfRange + shelfRange - 1 << ": " << range.second << "\n";
+		}
+		return text.str();
+	}
+};
+
+// The orders the library can list its books in.
+enum class SortOrder { Title, Author, Shelf, Count };
+
+// One book in a sorted list. The values it is sorted by are copied in when the entry is made,
+// so sorting compares strings directly instead of calling the book's virtual getters (which return copies) for every comparison.
+struct SortEntry {
+	int shelf;			// Only used for the shelf order, otherwise 0.
+	string first;		// Title, or author for the author order.
+	string second;		// Author, or title for the author and shelf orders. Used when two books have the same first value.
+	const Book* book;
+
+	bool operator<(const SortEntry& other) const {
+		if (shelf != other.shelf) {
+			return shelf < other.shelf;
+		}
+		int compared = first.compare(other.first);
+		return compared != 0 ? compared < 0 : second < other.second;
+	}
+};
+
+// Sorts the items using several threads. Each thread sorts an equal part, then neighbouring parts are merged in pairs (also on separate threads) until there is one part left.
+// Small lists are sorted on the calling thread, because starting the threads would take longer than the sort.
+template <typename T>
+void parallelSort(vector<T>& items, unsigned int threadCount) {
+	const size_t minPartSize = 16384;
+	size_t parts = min((size_t)threadCount, items.size() / minPartSize);
+	if (parts <= 1) {
+		sort(items.begin(), items.end());
+		return;
+	}
+
+	vector<size_t> bounds;	// Part i is from bounds[i] to bounds[i + 1].
+	for (size_t i = 0; i <= parts; i++) {
+		bounds.push_back(items.size() * i / parts);
+	}
+	vector<thread> threads;
+	for (size_t i = 0; i < parts; i++) {
+		threads.emplace_back([&items, &bounds, i]() { sort(items.begin() + bounds[i], items.begin() + bounds[i + 1]); });
+	}
+	for (thread& worker : threads) {
+		worker.join();
+	}
+
+	while (bounds.size() > 2) {
+		vector<size_t> mergedBounds;
+		threads.clear();
+		for (size_t i = 0; i + 2 < bounds.size(); i += 2) {
+			threads.emplace_back([&items, &bounds, i]() { inplace_merge(items.begin() + bounds[i], items.begin() + bounds[i + 1], items.begin() + bounds[i + 2]); });
+			mergedBounds.push_back(bounds[i]);
+		}
+		if ((bounds.size() - 1) % 2 == 1) {
+			mergedBounds.push_back(bounds[bounds.size() - 2]);	// An odd part out is merged in the next round.
+		}
+		mergedBounds.push_back(bounds.back());
+		for (thread& worker : threads) {
+			worker.join();
+		}
+		bounds = mergedBounds;
+	}
+}
+
 class Library {
 private:
 	// This creates a vector that stores pointers to 'Book' objects. 
@@ -152,7 +460,177 @@ private:
 	// This enables effecient memory usage by using pointers.
 	vector<Book*> books;
 
+	// Counts of the books by type, author and shelf. Every change to 'books' must also be made here.
+	CatalogStats stats;
+
+	// The books sorted in each 'SortOrder', only made the first time that order is asked for.
+	// After that, the changes made to the library are collected instead of sorting all the books again. The next time the order is asked for,
+	// the entries of removed and changed books are taken out, and new entries for the added and changed books are sorted and merged in.
+	// 'removed' holds addresses only, so it is safe for it to hold books that have since been deleted.
+	struct SortedView {
+		bool built = false;
+		vector<SortEntry> entries;
+		unordered_set<const Book*> removed;	// Books whose entry must be taken out.
+		unordered_set<const Book*> added;	// Books in the library that need a new entry.
+	};
+	SortedView sortedViews[(int)SortOrder::Count];
+	unsigned int sortThreads = max(1u, thread::hardware_concurrency());
+
+	// Every change to 'books' calls one of these, so the statistics and the sorted views stay up to date.
+	void bookAdded(const Book* book) {
+		stats.bookAdded(*book);
+		for (SortedView& view : sortedViews) {
+			if (view.built) {
+				view.added.insert(book);
+			}
+		}
+	}
+
+	void bookRemoved(const Book* book) {
+		stats.bookRemoved(*book);
+		for (SortedView& view : sortedViews) {
+			if (view.built) {
+				view.removed.insert(book);
+				view.added.erase(book);
+			}
+		}
+	}
+
+	void bookChanged(const Book* book) {
+		for (SortedView& view : sortedViews) {
+			if (view.built) {
+				view.removed.insert(book);
+				view.added.insert(book);
+			}
+		}
+	}
+
+	// Makes the entry for a book in the order given. Returns false if the book isn't in that order (online books have no shelf).
+	static bool makeSortEntry(SortOrder order, const Book* book, SortEntry& entry) {
+		entry.book = book;
+		entry.shelf = 0;
+		if (order == SortOrder::Title) {
+			entry.first = book->getTitle();
+			entry.second = book->getAuthor();
+			return true;
+		}
+		entry.first = book->getAuthor();
+		entry.second = book->getTitle();
+		if (order == SortOrder::Shelf) {
+			const PhysicalBook* physical = dynamic_cast<const PhysicalBook*>(book);
+			if (!physical) {
+				return false;
+			}
+			entry.shelf = physical->getShelfNum();
+			entry.first = book->getTitle();
+			entry.second = book->getAuthor();
+		}
+		return true;
+	}
+
+	// Brings a sorted view up to date.
+	// A small number of changes is merged into the view in O(n + k log k) for k changes. When more than a quarter of the books have changed the view is sorted again.
+	void refreshSortedView(SortOrder order) {
+		MemoryScope scope(MemoryTag::Indexes);
+		SortedView& view = sortedViews[(int)order];
+		SortEntry entry;
+		if (!view.built || view.removed.size() + view.added.size() > view.entries.size() / 4) {
+			view.entries.clear();
+			view.entries.reserve(books.size());
+			for (const Book* book : books) {
+				if (makeSortEntry(order, book, entry)) {
+					view.entries.push_back(move(entry));
+				}
+			}
+			parallelSort(view.entries, sortThreads);
+		}
+		else if (!view.removed.empty() || !view.added.empty()) {
+			if (!view.removed.empty()) {
+				view.entries.erase(remove_if(view.entries.begin(), view.entries.end(), [&view](const SortEntry& entry) { return view.removed.count(entry.book) > 0; }), view.entries.end());
+			}
+			vector<SortEntry> changes;
+			for (const Book* book : view.added) {
+				if (makeSortEntry(order, book, entry)) {
+					changes.push_back(move(entry));
+				}
+			}
+			sort(changes.begin(), changes.end());
+			vector<SortEntry> merged;
+			merged.reserve(view.entries.size() + changes.size());
+			merge(make_move_iterator(view.entries.begin()), make_move_iterator(view.entries.end()), make_move_iterator(changes.begin()), make_move_iterator(changes.end()), back_inserter(merged));
+			view.entries.swap(merged);
+		}
+		view.removed.clear();
+		view.added.clear();
+		view.built = true;
+	}
+
+	// Returns the position of the first book with a matching title or author, or -1 if there isn't one.
+	// Unlike 'getBookByTitle' these don't display the book, so they can be used when applying a batch.
+	// Every search in the library ignores case, accents written as separate characters and extra spaces,
+	// by normalising the text searched for once and comparing it to the keys each book made when it was added (see 'TextMatch').
+	int findIndexByTitle(const string& title) const {
+		string key = TextMatch::normalise(title);
+		for (size_t i = 0; i < books.size(); i++) {
+			if (TextMatch::equal(books[i]->getTitleKey(), key)) {
+				return (int)i;
+			}
+		}
+		return -1;
+	}
+
+	int findIndexByAuthor(const string& author) const {
+		string key = TextMatch::normalise(author);
+		for (size_t i = 0; i < books.size(); i++) {
+			if (TextMatch::equal(books[i]->getAuthorKey(), key)) {
+				return (int)i;
+			}
+		}
+		return -1;
+	}
+
 public:
+	// A change made by 'applyBatch' or 'applyMutation', kept so it can be undone if the server rejects it.
+	// A deleted book is kept in 'book' until 'keepChange' or 'undoChange' is called, so it can be put back.
+	struct UndoStep {
+		char operation;	// The 'BookMutation' operation, or ' ' if nothing was changed.
+		size_t index;	// Where a deleted book was.
+		Book* book;
+		string previous;	// The title or author before it was changed.
+	};
+
+	// Undoes a change. The book is found by its address rather than 'index', because the changes after it may have been kept and moved the books along.
+	// A book that a later, kept change deleted is no longer in the library, so an add or rename of it is left as it is.
+	// When undoing some changes and keeping others, every change must be undone (newest first) before any is kept, as keeping a delete deallocates the book.
+	void undoChange(const UndoStep& step, Librarian& librarian) {
+		auto it = find(books.begin(), books.end(), step.book);
+		if (step.operation == '2') {
+			books.insert(books.begin() + min(step.index, books.size()), step.book);
+			bookAdded(step.book);
+		}
+		else if (it == books.end()) {
+			return;
+		}
+		else if (step.operation == '1') {
+			books.erase(it);
+			bookRemoved(step.book);
+			delete step.book;
+		}
+		else if (step.operation == '3') {
+			changeBookTitle(librarian, *step.book, step.previous);
+		}
+		else if (step.operation == '4') {
+			changeBookAuthor(librarian, *step.book, step.previous);
+		}
+	}
+
+	// Keeps a change once the server has committed it. A deleted book can now be deallocated.
+	void keepChange(const UndoStep& step) {
+		if (step.operation == '2') {
+			delete step.book;
+		}
+	}
+
 	// Destructor
 	// Cleans up memory by iterating over each pointer and deallocating the memory.
 	~Library() {
@@ -163,7 +641,57 @@ public:
 
 	// Adds the book pointer (which points to the book object) to the end of the books vector.
 	void addBook(Book* book) {
+		MemoryScope scope(MemoryTag::Catalog);
 		books.push_back(book);
+		bookAdded(book);
+	}
+
+	// These methods change the title or author of a book through the librarian, keeping the library's statistics up to date.
+	void changeBookTitle(Librarian& librarian, const Book& book, const string& newTitle) {
+		librarian.modifiyBookTitle(book, newTitle);
+		bookChanged(&book);
+	}
+
+	void changeBookAuthor(Librarian& librarian, const Book& book, const string& newAuthor) {
+		stats.authorChanged(book.getAuthor(), newAuthor);
+		librarian.modifiyBookAuthor(book, newAuthor);
+		bookChanged(&book);
+	}
+
+	// Returns the books sorted by title, author or shelf. Books with the same title, author or shelf are sorted by the others.
+	// The shelf order only has physical books.
+	vector<const Book*> sortedBooks(SortOrder order) {
+		refreshSortedView(order);
+		const vector<SortEntry>& entries = sortedViews[(int)order].entries;
+		vector<const Book*> sorted;
+		sorted.reserve(entries.size());
+		for (const SortEntry& entry : entries) {
+			sorted.push_back(entry.book);
+		}
+		return sorted;
+	}
+
+	// Displays the books in the order given, like 'showAllBooks'.
+	void showSortedBooks(SortOrder order) {
+		for (const Book* book : sortedBooks(order)) {
+			book->display();
+		}
+	}
+
+	// Sets how many threads are used to sort the books. Used by the benchmark to compare one thread with several.
+	void setSortThreads(unsigned int threads) {
+		sortThreads = max(1u, threads);
+	}
+
+	// Throws away the sorted orders, so the next one asked for sorts every book again. Used by the benchmark.
+	void resetSortedViews() {
+		for (SortedView& view : sortedViews) {
+			view = SortedView();
+		}
+	}
+
+	const CatalogStats& getStats() const {
+		return stats;
 	}
 
 	// Loops through each book pointer and calls the display function which the book points to.
@@ -189,8 +717,9 @@ public:
 	// If the book is found, it will increment the counter, stopping the for loop, and then displaying that book.
 	bool showBookByTitle(const string& title) const {
 		int counter = 0;
+		string key = TextMatch::normalise(title);
 		for (const Book* book : books) {
-			if (book->getTitle() == title) {
+			if (TextMatch::equal(book->getTitleKey(), key)) {
 				counter++;
 				book->display();
 				break;
@@ -208,8 +737,9 @@ public:
 	// If the book is found, it will increment the counter, stopping the for loop, and then displaying that book.
 	bool showBookByAuthor(const string& author) const {
 		int counter = 0;
+		string key = TextMatch::normalise(author);
 		for (const Book* book : books) {
-			if (book->getAuthor() == author) {
+			if (TextMatch::equal(book->getAuthorKey(), key)) {
 				counter++;
 				book->display();
 				break;
@@ -226,8 +756,9 @@ public:
 	// Loops through each book pointer and checks if the book title is the same as title passed in as a parameter (Book requested by user).
 	// It then displays that book and returns it.
 	const Book* getBookByTitle(const string& title) const {
+		string key = TextMatch::normalise(title);
 		for (const Book* book : books) {
-			if (book->getTitle() == title) {
+			if (TextMatch::equal(book->getTitleKey(), key)) {
 				book->display();
 				return book;
 			}
@@ -238,8 +769,9 @@ public:
 	// Loops through each book pointer and checks if the book author is the same as author passed in as a parameter (Book requested by user).
 	// It then displays that book and returns it.
 	const Book* getBookByAuthor(const string& author) const {
+		string key = TextMatch::normalise(author);
 		for (const Book* book : books) {
-			if (book->getAuthor() == author) {
+			if (TextMatch::equal(book->getAuthorKey(), key)) {
 				book->display();
 				return book;
 			}
@@ -253,6 +785,7 @@ public:
 		auto it = find(books.begin(), books.end(), book);
 		if (it != books.end()) {
 			// The book pointer is a constant so it cannot be deleted, therefore the const qualifier needs to be removed.
+			bookRemoved(*it);
 			delete const_cast<Book*>(*it); // Deallocate memory
 			books.erase(it); // Remove pointer from vector
 			cout << "\nBook deleted...\n";
@@ -262,6 +795,146 @@ public:
 		}
 	}
 
+	// This method applies every change in the batch, in order, or none of them.
+	// Each change that is made is recorded so that if a later change fails (e.g. the book is not found), the earlier changes are undone in reverse order.
+	// 'statuses' gets one entry per change and 'serverMessages' gets the message to send to the server for each change.
+	// When the batch succeeds 'undoSteps' has one step per change (the same order as 'serverMessages'), and the caller must call 'keepChange'
+	// or 'undoChange' for each one once the server has answered. Deleted books are only deallocated by 'keepChange'.
+	bool applyBatch(const vector<BookMutation>& mutations, Librarian& librarian, vector<string>& statuses, vector<string>& serverMessages, vector<UndoStep>& undoSteps) {
+		MemoryScope scope(MemoryTag::Catalog);
+		undoSteps.clear();
+		statuses.assign(mutations.size(), "NOT APPLIED");
+		serverMessages.clear();
+
+		for (size_t i = 0; i < mutations.size(); i++) {
+			const BookMutation& mutation = mutations[i];
+			int index = -1;
+
+			if (mutation.operation == '1') {
+				Book* book;
+				if (mutation.bookType == 'p' || mutation.bookType == 'P') {
+					book = new PhysicalBook(mutation.title, mutation.author, mutation.shelfNum);
+					serverMessages.push_back("New Physical Book added to library titled: " + mutation.title + ", author: " + mutation.author);
+				}
+				else {
+					book = new OnlineBook(mutation.title, mutation.author, mutation.url);
+					serverMessages.push_back("New Online Book added to library titled: " + mutation.title + ", author: " + mutation.author);
+				}
+				books.push_back(book);
+				bookAdded(book);
+				undoSteps.push_back({ '1', books.size() - 1, book, "" });
+				statuses[i] = "OK";
+				continue;
+			}
+
+			index = (mutation.operation == '4') ? findIndexByAuthor(mutation.target) : findIndexByTitle(mutation.target);
+			if (index < 0 || (mutation.operation != '2' && mutation.operation != '3' && mutation.operation != '4')) {
+				statuses[i] = (index < 0) ? "NOT FOUND" : "INVALID";
+				// Undo every change already made, newest first, so the library is left exactly as it was.
+				for (auto it = undoSteps.rbegin(); it != undoSteps.rend(); ++it) {
+					undoChange(*it, librarian);
+				}
+				for (size_t j = 0; j < i; j++) {
+					statuses[j] = "ROLLED BACK";
+				}
+				serverMessages.clear();
+				undoSteps.clear();
+				return false;
+			}
+
+			Book* book = books[index];
+			if (mutation.operation == '2') {
+				serverMessages.push_back("Deleted book from library titled: " + book->getTitle() + ", author: " + book->getAuthor());
+				books.erase(books.begin() + index);
+				bookRemoved(book);
+				undoSteps.push_back({ '2', (size_t)index, book, "" });
+			}
+			else if (mutation.operation == '3') {
+				serverMessages.push_back("Book title updated in library from: " + book->getTitle() + ", to: " + mutation.title);
+				undoSteps.push_back({ '3', (size_t)index, book, book->getTitle() });
+				changeBookTitle(librarian, *book, mutation.title);
+			}
+			else {
+				serverMessages.push_back("Book author updated in library from: " + book->getAuthor() + ", to: " + mutation.author + ", title: " + book->getTitle());
+				undoSteps.push_back({ '4', (size_t)index, book, book->getAuthor() });
+				changeBookAuthor(librarian, *book, mutation.author);
+			}
+			statuses[i] = "OK";
+		}
+		return true;
+	}
+
+	// Counts the books of the class specified, like 'showBookByType' but without displaying them.
+	size_t countBooksByType(const string& type) const {
+		size_t count = 0;
+		for (const Book* book : books) {
+			if ((type == "PhysicalBook" && dynamic_cast<const PhysicalBook*>(book)) || (type == "OnlineBook" && dynamic_cast<const OnlineBook*>(book))) {
+				count++;
+			}
+		}
+		return count;
+	}
+
+	// Returns every book with a matching title and author, without displaying them. An empty title or author matches any book.
+	vector<const Book*> findBooks(const string& title, const string& author) const {
+		vector<const Book*> found;
+		string titleKey = TextMatch::normalise(title);
+		string authorKey = TextMatch::normalise(author);
+		for (const Book* book : books) {
+			if ((title.empty() || TextMatch::equal(book->getTitleKey(), titleKey)) && (author.empty() || TextMatch::equal(book->getAuthorKey(), authorKey))) {
+				found.push_back(book);
+			}
+		}
+		return found;
+	}
+
+	// This method applies a single change straight away, unlike 'applyBatch' which applies all the changes or none of them.
+	// It returns "OK", "NOT FOUND" or "INVALID", and when the change is made 'serverMessage' is set to the message to send to the server
+	// and 'undoStep' to the step that undoes it. The caller must call 'keepChange' or 'undoChange' with it once the server has answered.
+	string applyMutation(const BookMutation& mutation, Librarian& librarian, string& serverMessage, UndoStep& undoStep) {
+		MemoryScope scope(MemoryTag::Catalog);
+		if (mutation.operation == '1') {
+			Book* book;
+			if (mutation.bookType == 'p' || mutation.bookType == 'P') {
+				book = new PhysicalBook(mutation.title, mutation.author, mutation.shelfNum);
+				serverMessage = "New Physical Book added to library titled: " + mutation.title + ", author: " + mutation.author;
+			}
+			else {
+				book = new OnlineBook(mutation.title, mutation.author, mutation.url);
+				serverMessage = "New Online Book added to library titled: " + mutation.title + ", author: " + mutation.author;
+			}
+			addBook(book);
+			undoStep = { '1', books.size() - 1, book, "" };
+			return "OK";
+		}
+		if (mutation.operation != '2' && mutation.operation != '3' && mutation.operation != '4') {
+			return "INVALID";
+		}
+
+		int index = (mutation.operation == '4') ? findIndexByAuthor(mutation.target) : findIndexByTitle(mutation.target);
+		if (index < 0) {
+			return "NOT FOUND";
+		}
+		Book* book = books[index];
+		if (mutation.operation == '2') {
+			serverMessage = "Deleted book from library titled: " + book->getTitle() + ", author: " + book->getAuthor();
+			undoStep = { '2', (size_t)index, book, "" };
+			books.erase(books.begin() + index);
+			bookRemoved(book);
+		}
+		else if (mutation.operation == '3') {
+			serverMessage = "Book title updated in library from: " + book->getTitle() + ", to: " + mutation.title;
+			undoStep = { '3', (size_t)index, book, book->getTitle() };
+			changeBookTitle(librarian, *book, mutation.title);
+		}
+		else {
+			serverMessage = "Book author updated in library from: " + book->getAuthor() + ", to: " + mutation.author + ", title: " + book->getTitle();
+			undoStep = { '4', (size_t)index, book, book->getAuthor() };
+			changeBookAuthor(librarian, *book, mutation.author);
+		}
+		return "OK";
+	}
+
 	// This method displays the last book in the vector which would be the most recent book added.
 	void showNewestBook() const {
 		if (!books.empty()) { // check if the books vector is empty
@@ -274,14 +947,263 @@ public:
 
 };
 
+// The type specific parts of a book in the 'VariantLibrary'.
+struct PhysicalDetails {
+	int shelfNum;
+};
+
+struct OnlineDetails {
+	string url;
+};
+
+// A book in the 'VariantLibrary'. The title and author are plain members and the type specific part is a variant, so there are no virtual functions.
+// Records are stored by value in one vector, so a scan reads memory in order instead of following a pointer to each book.
+struct BookRecord {
+	string title;
+	string author;
+	variant<PhysicalDetails, OnlineDetails> details;
+};
+
+// Template specialisation
+// The behaviour of each book type is chosen at compile time from the type of its details, instead of through a virtual function.
+template <typename Details>
+struct RecordTraits;
+
+template <>
+struct RecordTraits<PhysicalDetails> {
+	static void display(const PhysicalDetails& details) {
+		cout << "Shelf Number: " << details.shelfNum << endl;
+	}
+};
+
+template <>
+struct RecordTraits<OnlineDetails> {
+	static void display(const OnlineDetails& details) {
+		cout << "Url: " << details.url << endl;
+	}
+};
+
+// This class is another way of storing the library, for comparison with the 'Book' class hierarchy used by 'Library'.
+// The set of book types is fixed (physical and online), so a 'std::variant' can hold either type without virtual functions or 'dynamic_cast'.
+// Checking a book's type is just reading the variant's index, and reading a title or author is a direct member access the compiler can inline.
+// It is a prototype for the 'benchmark' mode of the program only, which compares the two on scanning and filtering workloads.
+// It can only add, list and search books: there is no delete or rename, no statistics, sorted views or undo, and the menus,
+// scripts and server sync all use 'Library'. Those would have to be added before it could replace 'Library'.
+class VariantLibrary {
+private:
+	vector<BookRecord> books;
+	// The normalised title and author of each book, at the same position as the book. They are kept apart from the records
+	// so a search only reads the keys, instead of every record getting bigger.
+	vector<string> titleKeys;
+	vector<string> authorKeys;
+
+public:
+	void addPhysicalBook(const string& title, const string& author, int shelfNum) {
+		books.push_back({ title, author, PhysicalDetails{ shelfNum } });
+		titleKeys.push_back(TextMatch::normalise(title));
+		authorKeys.push_back(TextMatch::normalise(author));
+	}
+
+	void addOnlineBook(const string& title, const string& author, const string& url) {
+		books.push_back({ title, author, OnlineDetails{ url } });
+		titleKeys.push_back(TextMatch::normalise(title));
+		authorKeys.push_back(TextMatch::normalise(author));
+	}
+
+	size_t size() const {
+		return books.size();
+	}
+
+	// Displays a book in the same format as 'Book::display' and its overrides.
+	// 'visit' calls the lambda with the details the book actually holds, which then calls the display function for that type.
+	static void display(const BookRecord& book) {
+		cout << "Title: " << book.title << ", Author: " << book.author << endl;
+		visit([](const auto& details) {
+			RecordTraits<decay_t<decltype(details)>>::display(details);
+		}, book.details);
+	}
+
+	void showAllBooks() const {
+		for (const BookRecord& book : books) {
+			display(book);
+		}
+	}
+
+	// Displays only the books of the type given as the template argument, e.g. 'showBookByType<OnlineDetails>()'.
+	template <typename Details>
+	void showBookByType() const {
+		for (const BookRecord& book : books) {
+			if (holds_alternative<Details>(book.details)) {
+				display(book);
+			}
+		}
+	}
+
+	template <typename Details>
+	size_t countBooksByType() const {
+		size_t count = 0;
+		for (const BookRecord& book : books) {
+			count += holds_alternative<Details>(book.details);
+		}
+		return count;
+	}
+
+	// Returns every book with a matching title and author, the same as 'Library::findBooks'. An empty title or author matches any book.
+	vector<const BookRecord*> findBooks(const string& title, const string& author) const {
+		vector<const BookRecord*> found;
+		string titleKey = TextMatch::normalise(title);
+		string authorKey = TextMatch::normalise(author);
+		for (size_t i = 0; i < books.size(); i++) {
+			if ((title.empty() || TextMatch::equal(titleKeys[i], titleKey)) && (author.empty() || TextMatch::equal(authorKeys[i], authorKey))) {
+				found.push_back(&books[i]);
+			}
+		}
+		return found;
+	}
+};
+
+// Compares the 'Book' class hierarchy ('Library') with the variant records ('VariantLibrary') on the same synthetic catalog.
+// Each workload is run several times on both and the average time per pass is shown, along with the time per book.
+//   scan by title: finds one title, which means reading every book's title.
+//   filter by type: counts the physical books ('dynamic_cast' compared to reading the variant index).
+//   filter by author: finds every book by one author.
+void benchmarkBackends(size_t bookCount) {
+	const char* firstNames[] = { "Emma", "Liam", "Dylan", "James", "Grace", "Ava", "Nora", "Oliver", "Harper", "Sebastian", "Jasper", "Mason", "Leo", "Clara", "Henry", "Lena" };
+	const char* lastNames[] = { "Blackwood", "Hunter", "Cooper", "Whitmore", "Bennett", "Montgomery", "Stevens", "Gray", "Wilson", "Cole", "Ford", "White", "Knight", "Mills", "Wright", "Murphy" };
+	const char* words[] = { "Silent", "Echo", "Whispers", "Dark", "Last", "Embrace", "Forgotten", "Path", "Shadows", "Lost", "Hidden", "Garden", "Burning", "Sky", "Stars", "Storm" };
+	const int passes = 10;
+
+	unsigned int seed = 12345;
+	auto next = [&seed]() {
+		seed = seed * 1103515245u + 12345u;
+		return (seed >> 8);
+	};
+
+	Library library;
+	VariantLibrary variantLibrary;
+	string lastTitle;
+	for (size_t i = 0; i < bookCount; i++) {
+		string author = string(firstNames[next() % 16]) + " " + lastNames[next() % 16];
+		lastTitle = string("The ") + words[next() % 16] + " " + words[next() % 16] + " " + to_string(i);
+		if (i % 2 == 0) {
+			int shelfNum = next() % 250;
+			library.addBook(new PhysicalBook(lastTitle, author, shelfNum));
+			variantLibrary.addPhysicalBook(lastTitle, author, shelfNum);
+		}
+		else {
+			string url = "www.myOnlineBook/index/" + to_string(next());
+			library.addBook(new OnlineBook(lastTitle, author, url));
+			variantLibrary.addOnlineBook(lastTitle, author, url);
+		}
+	}
+	cout << "Benchmarking " << bookCount << " books, average of " << passes << " passes\n";
+
+	// Runs a workload 'passes' times and returns the average milliseconds per pass. The results are added up so the work can't be optimised away.
+	auto measure = [passes](auto workload, size_t& result) {
+		auto start = chrono::steady_clock::now();
+		for (int pass = 0; pass < passes; pass++) {
+			result += workload();
+		}
+		return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / passes;
+	};
+
+	auto report = [bookCount](const string& name, double virtualMs, double variantMs, bool match) {
+		cout << name << ": virtual " << virtualMs << " ms (" << virtualMs * 1e6 / bookCount << " ns/book), variant " << variantMs << " ms ("
+			<< variantMs * 1e6 / bookCount << " ns/book), " << virtualMs / variantMs << "x faster" << (match ? "" : " - RESULTS DIFFER") << endl;
+	};
+
+	string author = string(firstNames[0]) + " " + lastNames[0];
+	size_t virtualResult = 0, variantResult = 0;
+	double virtualMs = measure([&]() { return library.findBooks(lastTitle, "").size(); }, virtualResult);
+	double variantMs = measure([&]() { return variantLibrary.findBooks(lastTitle, "").size(); }, variantResult);
+	report("scan by title", virtualMs, variantMs, virtualResult == variantResult);
+
+	virtualResult = variantResult = 0;
+	virtualMs = measure([&]() { return library.countBooksByType("PhysicalBook"); }, virtualResult);
+	variantMs = measure([&]() { return variantLibrary.countBooksByType<PhysicalDetails>(); }, variantResult);
+	report("filter by type", virtualMs, variantMs, virtualResult == variantResult);
+
+	virtualResult = variantResult = 0;
+	virtualMs = measure([&]() { return library.findBooks("", author).size(); }, virtualResult);
+	variantMs = measure([&]() { return variantLibrary.findBooks("", author).size(); }, variantResult);
+	report("filter by author", virtualMs, variantMs, virtualResult == variantResult);
+
+	// Sorted views: the first sort with one thread and with every core, then bringing the sorted view up to date after a few changes.
+	unsigned int cores = max(1u, thread::hardware_concurrency());
+	const SortOrder orders[] = { SortOrder::Title, SortOrder::Author, SortOrder::Shelf };
+	const char* orderNames[] = { "title", "author", "shelf" };
+	for (int i = 0; i < 3; i++) {
+		double threadMs[2];
+		unsigned int threadCounts[2] = { 1, cores };
+		for (int run = 0; run < 2; run++) {
+			library.resetSortedViews();
+			library.setSortThreads(threadCounts[run]);
+			auto start = chrono::steady_clock::now();
+			size_t sortedCount = library.sortedBooks(orders[i]).size();
+			threadMs[run] = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+			// The changes are merged into the sorted order instead of sorting it again.
+			if (run == 1) {
+				for (int change = 0; change < 1000; change++) {
+					library.addBook(new PhysicalBook("Added " + to_string(next()), "New Author", next() % 250));
+				}
+				start = chrono::steady_clock::now();
+				size_t updatedCount = library.sortedBooks(orders[i]).size();
+				double updateMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+				cout << "sort by " << orderNames[i] << " (" << sortedCount << " books): 1 thread " << threadMs[0] << " ms, " << cores << " threads " << threadMs[1] << " ms, "
+					<< threadMs[0] / threadMs[1] << "x faster, update after 1000 adds " << updateMs << " ms (" << updatedCount << " books)" << endl;
+			}
+		}
+	}
+}
+
+// Options set on every client socket when it is created, including when it reconnects.
+// A buffer size of 0 keeps the size Windows picks.
+struct SocketOptions {
+	bool noDelay = true;				// Turns off Nagle's algorithm so small requests are sent straight away instead of waiting to be joined together.
+	int sendBufferSize = 0;
+	int recieveBufferSize = 0;
+	unsigned long keepAliveMs = 30000;	// How long a connection is idle before TCP starts checking the server is still there.
+	unsigned long keepAliveIntervalMs = 1000;
+	unsigned long replyTimeoutMs = 10000;	// How long a blocking recieve waits before the connection is treated as broken.
+};
+
 class ClientSocket {
 private:
 	SOCKET clientSocket;
 	sockaddr_in serverAddress;
+	SocketOptions options;
+	chrono::steady_clock::time_point lastActivity = chrono::steady_clock::now();	// When data was last sent or recieved, used to decide when a heartbeat is needed.
+
+	// Sets the options on the socket. A failed option is reported but doesn't stop the connection being used.
+	void applyOptions() {
+		BOOL noDelay = options.noDelay;
+		if (setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay)) == SOCKET_ERROR) {
+			cout << "setsockopt(TCP_NODELAY) failed: " << WSAGetLastError() << endl;
+		}
+		if (options.sendBufferSize > 0 && setsockopt(clientSocket, SOL_SOCKET, SO_SNDBUF, (const char*)&options.sendBufferSize, sizeof(int)) == SOCKET_ERROR) {
+			cout << "setsockopt(SO_SNDBUF) failed: " << WSAGetLastError() << endl;
+		}
+		if (options.recieveBufferSize > 0 && setsockopt(clientSocket, SOL_SOCKET, SO_RCVBUF, (const char*)&options.recieveBufferSize, sizeof(int)) == SOCKET_ERROR) {
+			cout << "setsockopt(SO_RCVBUF) failed: " << WSAGetLastError() << endl;
+		}
+		DWORD timeout = options.replyTimeoutMs;
+		if (setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout)) == SOCKET_ERROR) {
+			cout << "setsockopt(SO_RCVTIMEO) failed: " << WSAGetLastError() << endl;
+		}
+
+		// TCP keepalive notices a server that has gone away (e.g. the machine was turned off) even while the client isn't sending anything.
+		// SIO_KEEPALIVE_VALS turns it on and sets the timings, which are two hours by default.
+		tcp_keepalive keepAlive = { 1, options.keepAliveMs, options.keepAliveIntervalMs };
+		DWORD returned = 0;
+		if (WSAIoctl(clientSocket, SIO_KEEPALIVE_VALS, &keepAlive, sizeof(keepAlive), NULL, 0, &returned, NULL, NULL) == SOCKET_ERROR) {
+			cout << "WSAIoctl(SIO_KEEPALIVE_VALS) failed: " << WSAGetLastError() << endl;
+		}
+	}
 
 public:
 	// Constructor that initializes the socket and the server address
-	ClientSocket(int port, const char* ipAddress) : clientSocket(INVALID_SOCKET) {
+	ClientSocket(int port, const char* ipAddress, const SocketOptions& options = SocketOptions()) : clientSocket(INVALID_SOCKET), options(options) {
 		// Initialize the sockaddr_in structure with default values
 		memset(&serverAddress, 0, sizeof(serverAddress));
 
@@ -291,94 +1213,682 @@ public:
 			WSACleanup(); // Releases memory.
 			exit(1); // Exit
 		}
-		serverAddress.sin_port = htons(port); // Set port
+		serverAddress.sin_port = htons(port); // Set port
+	}
+
+	// Destructor
+	~ClientSocket() {
+		cleanUp();
+	}
+
+	// Initalises the winsock dll
+	bool initaliseWinsock() {
+		WSADATA wsaData; // Holds configuration data for initialising the windows sockets communication.
+		WORD wVersionRequested = MAKEWORD(2, 2); // Version 2.2 of winsock.
+		int wsaerr = WSAStartup(wVersionRequested, &wsaData); // Initalises the winsock library for communication.
+		if (wsaerr != 0) {
+			cout << "The Winsock dll not found!" << endl;
+			return false;
+		}
+		cout << "The Winsock dll found!" << endl;
+		cout << "The status: " << wsaData.szSystemStatus << endl;
+		return true;
+	}
+
+	// Create network socket for communication.
+	bool createSocket() {
+		clientSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP); // Creates a TCP socket using IPv4.
+		if (clientSocket == INVALID_SOCKET) { // Checks if socket is invalid.
+			cout << "Error at socket(): " << WSAGetLastError() << endl; // Returns latest error.
+			return false;
+		}
+		applyOptions();
+		cout << "socket() is OK!" << endl;
+		return true;
+	}
+
+	// Connects to a server using the client socket.
+	// Winsock is left running if the connection fails, so the client can try again with 'reconnect'.
+	bool connectToServer() {
+
+		if (connect(clientSocket, (SOCKADDR*)&serverAddress, sizeof(serverAddress)) == SOCKET_ERROR) { // Attempts to connect to the specified server address and server port.
+			cout << "Client: connect() - Failed to connect: " << WSAGetLastError() << endl; // Returns latest error.
+			return false;
+		}
+		lastActivity = chrono::steady_clock::now();
+		cout << "Client: connect() is OK." << endl;
+		cout << "Client: Can start sending and receiving data..." << endl;
+		return true;
+		
+	}
+
+	// Closes the connection and connects again with a new socket, e.g. after the server has restarted.
+	// Between attempts it waits a random time up to a limit that doubles each attempt (from 100 ms to 5 s).
+	// The random part stops every client that lost the server reconnecting at the same moment when it comes back.
+	bool reconnect(int attempts = 8) {
+		static mt19937 random(random_device{}());
+		const long baseDelayMs = 100, maxDelayMs = 5000;
+		if (clientSocket != INVALID_SOCKET) {
+			closesocket(clientSocket);
+			clientSocket = INVALID_SOCKET;
+		}
+		for (int attempt = 0; attempt < attempts; attempt++) {
+			if (attempt > 0) {
+				long limit = min(maxDelayMs, baseDelayMs << min(attempt - 1, 16));
+				long delay = uniform_int_distribution<long>(limit / 2, limit)(random);
+				cout << "Client: reconnecting to port " << ntohs(serverAddress.sin_port) << " in " << delay << " ms..." << endl;
+				this_thread::sleep_for(chrono::milliseconds(delay));
+			}
+			if (createSocket() && connectToServer()) {
+				return true;
+			}
+			if (clientSocket != INVALID_SOCKET) {
+				closesocket(clientSocket);
+				clientSocket = INVALID_SOCKET;
+			}
+		}
+		return false;
+	}
+
+	// Returns how long the connection has been idle in milliseconds.
+	long long idleMilliseconds() const {
+		return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - lastActivity).count();
+	}
+
+	// Coroutine versions of 'connectToServer', 'sendMessage' and 'recieveMessage', run on an event loop so several servers can be used at once.
+	// The socket is only non-blocking while one of these is running, so the blocking methods can still be used afterwards.
+	// A timeout below zero waits forever. The token can be used to cancel the operation early.
+	Task<bool> connectToServerAsync(EventLoop& loop, long timeoutMs = -1, CancelToken* token = nullptr) {
+		AsyncSocket socket(loop, clientSocket, token);
+		IoStatus status = co_await socket.connect(serverAddress, timeoutMs);
+		setNonBlocking(clientSocket, false);
+		if (status != IoStatus::Ok) {
+			cout << "Client: connect() - Failed to connect: " << WSAGetLastError() << endl; // Returns latest error.
+			co_return false;
+		}
+		lastActivity = chrono::steady_clock::now();
+		cout << "Client: connect() is OK." << endl;
+		co_return true;
+	}
+
+	Task<bool> sendMessageAsync(EventLoop& loop, const string& message, long timeoutMs = -1, CancelToken* token = nullptr) {
+		AsyncSocket socket(loop, clientSocket, token);
+		IoStatus status = co_await socket.send(message, timeoutMs);
+		setNonBlocking(clientSocket, false);
+		if (status != IoStatus::Ok) {
+			cout << "\nMessage failed to send: " << WSAGetLastError() << endl; // Returns latest error.
+			co_return false;
+		}
+		lastActivity = chrono::steady_clock::now();
+		co_return true;
+	}
+
+	Task<bool> recieveMessageAsync(EventLoop& loop, string& result, long timeoutMs = -1, CancelToken* token = nullptr) {
+		AsyncSocket socket(loop, clientSocket, token);
+		IoStatus status = co_await socket.recv(result, timeoutMs);
+		setNonBlocking(clientSocket, false);
+		if (status != IoStatus::Ok) {
+			cout << "\nRecieving message failed: " << WSAGetLastError() << endl; // Returns latest error.
+			co_return false;
+		}
+		lastActivity = chrono::steady_clock::now();
+		co_return true;
+	}
+
+	// Send a message to the server.
+	// 'send' may not send the whole message at once, so it keeps sending until every byte has been sent.
+	bool sendMessage(const string& message) {
+		size_t sent = 0;
+		while (sent < message.length()) {
+			int byteCount = send(clientSocket, message.c_str() + sent, message.length() - sent, 0); // Sends message using the connected client socket.
+
+			// If bytecount is the same as the socket error code, the message failed to send.
+			if (byteCount == SOCKET_ERROR) {
+				cout << "\nMessage failed to send: " << WSAGetLastError() << endl; // Returns latest error.
+				return false;
+			}
+			sent += byteCount;
+		}
+		lastActivity = chrono::steady_clock::now();
+		cout << "\nMessage sent: " << message << endl;
+		return true;
+	}
+
+	// Recieves message from the server.
+	bool recieveMessage(string& result) {
+		MemoryScope scope(MemoryTag::Network);
+		// Creates a character array of 512 bytes, with each value being set to 0.
+		// This is to ensure the buffer is cleared before receiving data so it prevents any possible left over data from affecing the recieved message. from the server.
+		char buffer[512] = { 0 }; 
+		int byteCount = recv(clientSocket, buffer, sizeof(buffer), 0); // Receive message from server.
+
+		// If bytecount > 0, then a message was recieved.
+		if (byteCount > 0) {
+			result = string(buffer, byteCount);
+			lastActivity = chrono::steady_clock::now();
+			return true;
+		}
+		else {
+			cout << "\nRecieving message failed: " << WSAGetLastError() << endl; // Returns latest error.
+		}
+		return false;
+	}
+
+	// Recieves messages from the server until the result ends with the terminator.
+	// This is used for responses that may be larger than a single 'recv' call, such as a batch acknowledgement.
+	bool recieveUntil(const string& terminator, string& result) {
+		MemoryScope scope(MemoryTag::Network);
+		result.clear();
+		string part;
+		while (result.length() < terminator.length() || result.compare(result.length() - terminator.length(), terminator.length(), terminator) != 0) {
+			if (!recieveMessage(part)) {
+				return false;
+			}
+			result += part;
+		}
+		return true;
+	}
+
+	// Close the socket and deallocate memory.
+	void cleanUp() {
+		if (clientSocket != INVALID_SOCKET) {
+			closesocket(clientSocket);
+			clientSocket = INVALID_SOCKET;
+		}
+		WSACleanup(); // Releases memory.
+	}
+
+
+};
+
+// A book as listed by a server, used when merging and rebalancing the catalogs of several servers.
+struct ServerBook {
+	string type;	// "Physical" or "Online"
+	string title;
+	string author;
+};
+
+// This class splits the catalog across several servers (shards) and sends each request to the shard that owns the book.
+// Ownership uses consistent hashing of the book title. Each shard is placed at several points on a ring of hash values,
+// and a title belongs to the first shard point at or after the title's hash. Adding a shard therefore only moves the titles in the ranges it takes over.
+class ShardRouter {
+private:
+	vector<ClientSocket*> shards;	// One connection per server, owned by the router.
+	vector<int> ports;
+	map<unsigned int, size_t> ring;	// Hash point -> shard index.
+	const char* ipAddress;
+	SocketOptions socketOptions;
+	static const int pointsPerShard = 64; // More points spread the titles more evenly across shards.
+	static const long long heartbeatMs = 15000; // A connection idle for longer than this is checked with a "Status" request before it is used.
+	string clientId;	// Sent with every change, with the number of the change, so a server doesn't apply a replayed change twice.
+	unsigned long long nextRequestNumber = 1;
+
+	// 32-bit FNV-1a hash, used to place both shards and titles on the ring.
+	static unsigned int hashKey(const string& key) {
+		unsigned int hash = 2166136261u;
+		for (unsigned char c : key) {
+			hash ^= c;
+			hash *= 16777619u;
+		}
+		return hash;
+	}
+
+	// Returns the text between 'start' and 'end' in the message, or an empty string if either marker is missing.
+	// An empty 'end' returns everything after 'start'.
+	static string extractBetween(const string& message, const string& start, const string& end) {
+		size_t from = message.find(start);
+		if (from == string::npos) {
+			return "";
+		}
+		from += start.length();
+		size_t to = end.empty() ? message.length() : message.find(end, from);
+		if (to == string::npos) {
+			return "";
+		}
+		return message.substr(from, to - from);
+	}
+
+	// Every request is sent ending with a newline (a batch already ends with its "Batch end" line), so the server can tell when all of it has arrived.
+	static string frameRequest(const string& message) {
+		return !message.empty() && message.back() == '\n' ? message : message + "\n";
+	}
+
+	// Sends a request to one shard and waits for the reply.
+	// If a terminator is given, the reply is read until it ends with the terminator.
+	// A large reply may arrive as a "Compressed <size>" line followed by compressed data, in which case it is read in full and decompressed.
+	static bool exchange(ClientSocket& shard, const string& message, string& response, const string& terminator) {
+		MemoryScope scope(MemoryTag::Network);
+		if (!shard.sendMessage(frameRequest(message))) {
+			return false;
+		}
+		response.clear();
+		string part;
+		while (!replyComplete(response, terminator)) {
+			if (!shard.recieveMessage(part)) {
+				return false;
+			}
+			response += part;
+		}
+		return decodeReply(response);
+	}
+
+	// Returns true if the message changes a server's catalog.
+	static bool isChange(const string& message) {
+		return message.rfind("New ", 0) == 0 || message.rfind("Deleted ", 0) == 0 || message.rfind("Book title updated", 0) == 0
+			|| message.rfind("Book author updated", 0) == 0 || message.rfind("Batch begin", 0) == 0;
+	}
+
+	// Sends a request to one shard, reconnecting if the connection has broken (e.g. the server restarted).
+	// A connection that has been idle for a while is checked with a heartbeat first, so a change isn't sent into a dead connection.
+	// A request that wasn't answered is unacknowledged, so after reconnecting it is sent again (replayed).
+	// A change is sent after a "Request <client> <number>" line. If the server applied it before the connection broke,
+	// the replay has the same number, so the server sends the first response again instead of applying the change twice.
+	bool request(ClientSocket& shard, const string& message, string& response, const string& terminator = "") {
+		string sent = isChange(message) ? "Request " + clientId + " " + to_string(nextRequestNumber++) + "\n" + message : message;
+		if (shard.idleMilliseconds() > heartbeatMs && !exchange(shard, "Status", response, "")) {
+			cout << "\nServer didn't answer the heartbeat, reconnecting..." << endl;
+			if (!reconnect(shard)) {
+				return false;
+			}
+		}
+		if (exchange(shard, sent, response, terminator)) {
+			return true;
+		}
+
+		cout << "\nConnection lost, reconnecting to replay the request..." << endl;
+		if (!reconnect(shard)) {
+			return false;
+		}
+		return exchange(shard, sent, response, terminator);
+	}
+
+	// Reconnects to a shard and asks for compression again, as the server treats it as a new client.
+	static bool reconnect(ClientSocket& shard) {
+		string reply;
+		return shard.reconnect() && exchange(shard, "Compression LZ", reply, "");
+	}
+
+	// Coroutine version of 'request', used to send the same request to every shard at once.
+	// 'message' and 'terminator' are taken by value so they are kept in the coroutine, because the caller's strings may be gone by the time it runs.
+	// A failed request only fails its own shard. The other shards carry on, so each of them reads the whole of its reply and its connection can be used again.
+	// 'ok' is set to whether the whole reply arrived.
+	static Task<void> requestAsync(EventLoop& loop, ClientSocket& shard, string message, string& response, string terminator, char& ok) {
+		const long timeoutMs = 10000;
+		response.clear();
+		string part;
+		ok = co_await shard.sendMessageAsync(loop, frameRequest(message), timeoutMs);
+		while (ok && !replyComplete(response, terminator)) {
+			ok = co_await shard.recieveMessageAsync(loop, part, timeoutMs);
+			response += part;
+		}
+		if (!ok || !decodeReply(response)) {
+			response.clear();
+			ok = false;
+		}
+	}
+
+	// Returns true once a reply has fully arrived. That is all of a compressed reply, or a reply ending with the terminator (or any reply if there isn't one).
+	static bool replyComplete(const string& response, const string& terminator) {
+		if (response.rfind("Compressed ", 0) == 0) {
+			size_t headerEnd = response.find('\n');
+			return headerEnd != string::npos && response.length() >= headerEnd + 1 + stoull(response.substr(11, headerEnd - 11));
+		}
+		if (terminator.empty()) {
+			return !response.empty();
+		}
+		return response.length() >= terminator.length() && response.compare(response.length() - terminator.length(), terminator.length(), terminator) == 0;
+	}
+
+	// Decompresses a compressed reply in place. Returns false if the compressed data is invalid.
+	static bool decodeReply(string& response) {
+		if (response.rfind("Compressed ", 0) != 0) {
+			return true;
+		}
+		string compressed = response.substr(response.find('\n') + 1);
+		return BlockCompressor::decompress(compressed, response);
+	}
+
+	// Splits a "List books" reply into books.
+	static vector<ServerBook> parseListing(const string& listing) {
+		vector<ServerBook> books;
+		stringstream ss(listing);
+		string line;
+		while (getline(ss, line)) {
+			size_t first = line.find('\t');
+			size_t second = line.find('\t', first + 1);
+			if (first != string::npos && second != string::npos) {
+				books.push_back({ line.substr(0, first), line.substr(first + 1, second - first - 1), line.substr(second + 1) });
+			}
+		}
+		return books;
+	}
+
+	// After a title change, the book may now belong to a different shard.
+	// If so, it is copied to the shard that owns the new title and deleted from the shard it was on.
+	void moveIfMisplaced(const string& title, size_t from) {
+		size_t owner = shardFor(title);
+		string found, response;
+		if (owner == from || !request(*shards[from], "Find title: " + title, found) || found.rfind("Found ", 0) != 0) {
+			return;
+		}
+		string type = extractBetween(found, "Found ", " book titled: ");
+		string author = extractBetween(found, ", author: ", "\n");
+		// The book is only deleted once the owner has added it, so a failed add doesn't lose it.
+		if (request(*shards[owner], "New " + type + " Book added to library titled: " + title + ", author: " + author, response) && response.rfind("Server added new ", 0) == 0) {
+			request(*shards[from], "Deleted book from library titled: " + title + ", author: " + author, response);
+		}
+	}
+
+	// Returns a batch request holding messages 'start' to 'end'.
+	static string makeBatch(const vector<string>& messages, size_t start, size_t end) {
+		string batch = "Batch begin " + to_string(end - start) + "\n";
+		for (size_t i = start; i < end; i++) {
+			batch += messages[i] + "\n";
+		}
+		return batch + "Batch end\n";
+	}
+
+	// Sends changes to one shard as batches of up to 'maxBatchSize' changes, and returns which of the changes were committed.
+	// Each batch is applied all or nothing, so a change only counts as committed if its whole batch was.
+	vector<char> sendInBatches(size_t shard, const vector<string>& messages) {
+		const size_t maxBatchSize = 1000;
+		vector<char> committed(messages.size(), false);
+		for (size_t start = 0; start < messages.size(); start += maxBatchSize) {
+			size_t end = min(messages.size(), start + maxBatchSize);
+			string reply;
+			if (request(*shards[shard], makeBatch(messages, start, end), reply, "Batch end\n") && reply.rfind("Batch committed", 0) == 0) {
+				fill(committed.begin() + start, committed.begin() + end, true);
+			}
+		}
+		return committed;
+	}
+
+	// Adds a connected shard to the ring.
+	// When a shard joins servers that are already running, the books it started with are out of date, so they are deleted first.
+	void registerShard(ClientSocket* shard, int port, bool joinRunning) {
+		// Large replies such as catalog listings are sent compressed.
+		string reply;
+		request(*shard, "Compression LZ", reply);
+		if (joinRunning) {
+			string listing, response;
+			request(*shard, "List books", listing, "List end\n");
+			for (const ServerBook& book : parseListing(listing)) {
+				request(*shard, "Deleted book from library titled: " + book.title + ", author: " + book.author, response);
+			}
+		}
+		MemoryScope scope(MemoryTag::Indexes);
+		shards.push_back(shard);
+		ports.push_back(port);
+		for (int point = 0; point < pointsPerShard; point++) {
+			ring[hashKey(to_string(port) + "#" + to_string(point))] = shards.size() - 1;
+		}
+	}
+
+public:
+	// The client id is random, so two clients (or one client started again) don't share request numbers.
+	ShardRouter(const char* ipAddress, const SocketOptions& socketOptions = SocketOptions()) : ipAddress(ipAddress), socketOptions(socketOptions) {
+		random_device random;
+		clientId = to_string(((unsigned long long)random() << 32) | random());
 	}
 
 	// Destructor
-	~ClientSocket() {
-		cleanUp();
+	// Closes the connection to every shard.
+	~ShardRouter() {
+		for (ClientSocket* shard : shards) {
+			delete shard;
+		}
 	}
 
-	// Initalises the winsock dll
-	bool initaliseWinsock() {
-		WSADATA wsaData; // Holds configuration data for initialising the windows sockets communication.
-		WORD wVersionRequested = MAKEWORD(2, 2); // Version 2.2 of winsock.
-		int wsaerr = WSAStartup(wVersionRequested, &wsaData); // Initalises the winsock library for communication.
-		if (wsaerr != 0) {
-			cout << "The Winsock dll not found!" << endl;
+	// Connects to a new shard and adds it to the ring. Call 'rebalance' afterwards to move the books it now owns onto it.
+	bool addShard(int port, bool joinRunning = false) {
+		ClientSocket* shard = new ClientSocket(port, ipAddress, socketOptions);
+		if (!shard->initaliseWinsock() || !shard->createSocket() || !shard->connectToServer()) {
+			delete shard;
 			return false;
 		}
-		cout << "The Winsock dll found!" << endl;
-		cout << "The status: " << wsaData.szSystemStatus << endl;
+		registerShard(shard, port, joinRunning);
 		return true;
 	}
 
-	// Create network socket for communication.
-	bool createSocket() {
-		clientSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP); // Creates a TCP socket using IPv4.
-		if (clientSocket == INVALID_SOCKET) { // Checks if socket is invalid.
-			cout << "Error at socket(): " << WSAGetLastError() << endl; // Returns latest error.
-			WSACleanup(); // Releases memory.
-			return false;
+	// Connects to all the shards at once on an event loop, rather than waiting for each connection in turn.
+	// A shard that doesn't connect straight away (e.g. its server is still starting) is tried again with 'reconnect'.
+	// Returns false, without adding any of them, if any connection still fails.
+	bool addShards(const vector<int>& newPorts) {
+		MemoryScope scope(MemoryTag::Network);
+		vector<ClientSocket*> newShards;
+		for (int port : newPorts) {
+			newShards.push_back(new ClientSocket(port, ipAddress, socketOptions));
+			if (!newShards.back()->initaliseWinsock() || !newShards.back()->createSocket()) {
+				break;
+			}
 		}
-		cout << "socket() is OK!" << endl;
-		return true;
+
+		vector<char> connected(newShards.size(), false);
+		if (newShards.size() == newPorts.size()) {
+			EventLoop loop;
+			for (size_t i = 0; i < newShards.size(); i++) {
+				loop.spawn([](EventLoop& loop, ClientSocket& shard, char& result) -> Task<void> {
+					result = co_await shard.connectToServerAsync(loop, 5000);
+				}(loop, *newShards[i], connected[i]));
+			}
+			loop.run();
+			for (size_t i = 0; i < newShards.size(); i++) {
+				if (!connected[i]) {
+					connected[i] = newShards[i]->reconnect();
+				}
+			}
+		}
+
+		bool ok = newShards.size() == newPorts.size() && find(connected.begin(), connected.end(), false) == connected.end();
+		for (size_t i = 0; i < newShards.size(); i++) {
+			if (ok) {
+				registerShard(newShards[i], newPorts[i], false);
+			}
+			else {
+				delete newShards[i];
+			}
+		}
+		return ok;
 	}
 
-	// Connects to a server using the client socket.
-	bool connectToServer() {
+	size_t shardCount() const {
+		return shards.size();
+	}
 
-		if (connect(clientSocket, (SOCKADDR*)&serverAddress, sizeof(serverAddress)) == SOCKET_ERROR) { // Attempts to connect to the specified server address and server port.
-			cout << "Client: connect() - Failed to connect: " << WSAGetLastError() << endl; // Returns latest error.
-			WSACleanup(); // Releases memory.
-			return false;
+	// Returns the index of the shard that owns the title.
+	// The normalised title is hashed, so titles the servers match as the same (e.g. "Dune" and "dune") are on the same shard.
+	size_t shardFor(const string& title) const {
+		auto it = ring.lower_bound(hashKey(TextMatch::normalise(title)));
+		if (it == ring.end()) {
+			it = ring.begin(); // Wrap around the ring.
 		}
-		cout << "Client: connect() is OK." << endl;
-		cout << "Client: Can start sending and receiving data..." << endl;
-		return true;
-		
+		return it->second;
 	}
 
-	// Send a message to the server.
-	bool sendMessage(const string& message) {
-		int byteCount = send(clientSocket, message.c_str(), message.length(), 0); // Sends message using the connected client socket.
+	// Returns the title a client message is about, which decides the shard it is sent to.
+	static string keyOf(const string& message) {
+		if (message.find(", title: ") != string::npos) {
+			return extractBetween(message, ", title: ", "");	// Author change
+		}
+		if (message.find("titled: ") != string::npos) {
+			return extractBetween(message, "titled: ", ", author: ");	// Add or delete
+		}
+		return extractBetween(message, "from: ", ", to: ");	// Title change
+	}
 
-		// If bytecount is the same as the socket error code, the message failed to send.
-		if (byteCount == SOCKET_ERROR) {
-			cout << "\nMessage failed to send: " << WSAGetLastError() << endl; // Returns latest error.
+	// Sends a client message to the shard that owns the book.
+	bool send(const string& message, string& response) {
+		size_t shard = shardFor(keyOf(message));
+		if (!request(*shards[shard], message, response)) {
 			return false;
 		}
-		cout << "\nMessage sent: " << message << endl;
+		if (message.rfind("Book title updated", 0) == 0 && response.find("could not") == string::npos) {
+			moveIfMisplaced(extractBetween(message, ", to: ", ""), shard);
+		}
 		return true;
 	}
 
-	// Recieves message from the server.
-	bool recieveMessage(string& result) {
-		// Creates a character array of 512 bytes, with each value being set to 0.
-		// This is to ensure the buffer is cleared before receiving data so it prevents any possible left over data from affecing the recieved message. from the server.
-		char buffer[512] = { 0 }; 
-		int byteCount = recv(clientSocket, buffer, sizeof(buffer), 0); // Receive message from server.
+	// Sends a batch of changes as one batch request per shard, each holding the changes for the books that shard owns.
+	// Each shard applies its part all or nothing. The replies are joined together.
+	// 'committed' gets one entry per message, set if the shard that owns it committed its part. Returns false if a shard couldn't be reached.
+	bool sendBatch(const vector<string>& messages, string& response, vector<char>& committed) {
+		vector<vector<size_t>> groups(shards.size());
+		for (size_t i = 0; i < messages.size(); i++) {
+			groups[shardFor(keyOf(messages[i]))].push_back(i);
+		}
 
-		// If bytecount > 0, then a message was recieved.
-		if (byteCount > 0) {
-			result = string(buffer, byteCount);
-			return true;
+		response.clear();
+		committed.assign(messages.size(), false);
+		bool reached = true;
+		for (size_t shard = 0; shard < groups.size(); shard++) {
+			if (groups[shard].empty()) {
+				continue;
+			}
+			vector<string> group;
+			for (size_t i : groups[shard]) {
+				group.push_back(messages[i]);
+			}
+			string result;
+			if (!request(*shards[shard], makeBatch(group, 0, group.size()), result, "Batch end\n")) {
+				reached = false;
+				continue;
+			}
+			response += "Server " + to_string(ports[shard]) + ": " + result;
+			if (result.rfind("Batch committed", 0) == 0) {
+				for (size_t i : groups[shard]) {
+					committed[i] = true;
+					if (messages[i].rfind("Book title updated", 0) == 0) {
+						moveIfMisplaced(extractBetween(messages[i], ", to: ", ""), shard);
+					}
+				}
+			}
 		}
-		else {
-			cout << "\nRecieving message failed: " << WSAGetLastError() << endl; // Returns latest error.
+		return reached;
+	}
+
+	// Asks every shard for its books at the same time, one coroutine per shard on a single event loop.
+	// Returns false if any shard couldn't be listed, in which case its listing is empty.
+	bool listEachShard(vector<vector<ServerBook>>& listings) {
+		MemoryScope scope(MemoryTag::Network);
+		vector<string> responses(shards.size());
+		vector<char> listed(shards.size(), false);
+		EventLoop loop;
+		for (size_t i = 0; i < shards.size(); i++) {
+			loop.spawn(requestAsync(loop, *shards[i], "List books", responses[i], "List end\n", listed[i]));
 		}
-		return false;
+		loop.run();
+
+		// A shard whose request failed is asked again on its own. Part of its reply may still be waiting on the connection,
+		// which the next request would read as its own reply, so the shard is reconnected first.
+		for (size_t i = 0; i < shards.size(); i++) {
+			if (!listed[i]) {
+				listed[i] = reconnect(*shards[i]) && request(*shards[i], "List books", responses[i], "List end\n");
+				if (!listed[i]) {
+					responses[i].clear();
+				}
+			}
+		}
+
+		listings.clear();
+		for (const string& response : responses) {
+			listings.push_back(parseListing(response));
+		}
+		return find(listed.begin(), listed.end(), false) == listed.end();
 	}
 
-	// Close the socket and deallocate memory.
-	void cleanUp() {
-		if (clientSocket != INVALID_SOCKET) {
-			closesocket(clientSocket);
+	// Asks every shard to save its catalog to a compressed snapshot file, and returns how many succeeded.
+	size_t saveSnapshots() {
+		size_t saved = 0;
+		string response;
+		for (ClientSocket* shard : shards) {
+			if (request(*shard, "Save snapshot", response) && response.rfind("Snapshot saved", 0) == 0) {
+				saved++;
+			}
 		}
-		WSACleanup(); // Releases memory.
+		return saved;
+	}
+
+	// Asks every shard how much memory it is using, and returns their reports one after another.
+	string memoryStats() {
+		string stats, response;
+		for (size_t shard = 0; shard < shards.size(); shard++) {
+			if (request(*shards[shard], "Memory stats", response, "Memory end\n")) {
+				stats += "Server " + to_string(ports[shard]) + ":\n" + response.substr(0, response.length() - 11);
+			}
+		}
+		return stats;
+	}
+
+	// Lists the books on every shard merged into one list sorted by title.
+	vector<ServerBook> listAll() {
+		vector<ServerBook> books;
+		vector<vector<ServerBook>> listings;
+		listEachShard(listings);
+		for (const vector<ServerBook>& listing : listings) {
+			books.insert(books.end(), listing.begin(), listing.end());
+		}
+		sort(books.begin(), books.end(), [](const ServerBook& a, const ServerBook& b) { return a.title < b.title; });
+		return books;
 	}
 
+	// Moves every book that is on the wrong shard to the shard that owns it, and returns how many books were moved.
+	// After a shard is added only the books in the ranges it took over are on the wrong shard, so only those move.
+	// A book that the owning shard already has (e.g. every server starting with the same books) is just deleted from the wrong shard.
+	// Nothing is moved unless every shard could be listed, because a shard that failed to list would look like it has no books.
+	// The moves are sent as batches: first the adds to each owner, then the deletes from each shard. A book is only deleted
+	// from the shard it was on once the owner has committed the batch that adds it, so a failed add never loses a book.
+	size_t rebalance() {
+		vector<vector<ServerBook>> listings;
+		if (!listEachShard(listings)) {
+			cout << "\nCould not list every server, the books were not moved..." << endl;
+			return 0;
+		}
+		// A book is identified by its type and its normalised title and author, so two books with the same title but different authors are both moved.
+		auto bookKey = [](const ServerBook& book) {
+			return book.type + "\t" + TextMatch::normalise(book.title) + "\t" + TextMatch::normalise(book.author);
+		};
+		vector<unordered_set<string>> held(shards.size());
+		for (size_t shard = 0; shard < listings.size(); shard++) {
+			for (const ServerBook& book : listings[shard]) {
+				held[shard].insert(bookKey(book));
+			}
+		}
+
+		vector<vector<string>> adds(shards.size()), deletes(shards.size());
+		vector<vector<pair<size_t, string>>> deletesAfterAdd(shards.size());	// For each owner, the deletes to send once its adds are committed.
+		for (size_t shard = 0; shard < listings.size(); shard++) {
+			for (const ServerBook& book : listings[shard]) {
+				size_t owner = shardFor(book.title);
+				if (owner == shard) {
+					continue;
+				}
+				string deleteMessage = "Deleted book from library titled: " + book.title + ", author: " + book.author;
+				if (held[owner].count(bookKey(book))) {
+					deletes[shard].push_back(deleteMessage);
+				}
+				else {
+					adds[owner].push_back("New " + book.type + " Book added to library titled: " + book.title + ", author: " + book.author);
+					deletesAfterAdd[owner].push_back({ shard, deleteMessage });
+					held[owner].insert(bookKey(book));
+				}
+			}
+		}
 
+		for (size_t owner = 0; owner < adds.size(); owner++) {
+			vector<char> added = sendInBatches(owner, adds[owner]);
+			for (size_t i = 0; i < added.size(); i++) {
+				if (added[i]) {
+					deletes[deletesAfterAdd[owner][i].first].push_back(deletesAfterAdd[owner][i].second);
+				}
+			}
+		}
+		size_t moved = 0;
+		for (size_t shard = 0; shard < deletes.size(); shard++) {
+			vector<char> deleted = sendInBatches(shard, deletes[shard]);
+			moved += count(deleted.begin(), deleted.end(), (char)true);
+		}
+		return moved;
+	}
 };
 
 // This method is used to show Functional pointers.
@@ -387,23 +1897,327 @@ void startMessage() {
 	cout << "----------Library Management System----------" << endl; 
 }
 
-// This method is used to send messages to the winsock server. 
+// This method is used to send messages to the winsock server that owns the book. 
 // It checks if the message is sent, if so it gets the response and displays it.
 // 'sendMessage' and 'recieveMessage' handle errors.
-void sendServerMessage(string message, ClientSocket& client) {
-	if (client.sendMessage(message)) {
+void sendServerMessage(string message, ShardRouter& router) {
+	string result;
+	if (router.send(message, result)) {
+		cout << "Server response: " << result << endl;
+	}
+}
+// This method sends a batch of changes to the servers in a single request per server instead of one request per change.
+// Each server applies its part of the batch or none of it and replies with one status line per change.
+// 'committed' gets one entry per change, set if the server that owns it committed it.
+void sendServerBatch(const vector<string>& messages, ShardRouter& router, vector<char>& committed) {
+	string result;
+	router.sendBatch(messages, result, committed);
+	if (!result.empty()) {
+		cout << "Server response: " << result << endl;
+	}
+}
+
+// Splits a line of a script into its tab separated fields.
+vector<string> splitFields(const string& line) {
+	vector<string> fields;
+	size_t start = 0, tab;
+	while ((tab = line.find('\t', start)) != string::npos) {
+		fields.push_back(line.substr(start, tab - start));
+		start = tab + 1;
+	}
+	fields.push_back(line.substr(start));
+	return fields;
+}
+
+// A change a script has made to the library but not yet sent to the servers.
+struct PendingChange {
+	size_t lineNumber;
+	string serverMessage;
+	Library::UndoStep undoStep;
+};
+
+// Sends the changes made so far to the servers as batches, and reports whether every server committed them.
+// Every shard applies its part of a batch all or nothing, so a shard that rejects its part rejects every change in it.
+// One "SYNC" line is written per flush, then an "ERROR" line for each change that wasn't committed, with the line number of the command that made it.
+// Those changes are undone in the library (newest first), so the library keeps matching the servers.
+void flushServerChanges(vector<PendingChange>& pending, Library& library, Librarian& librarian, ShardRouter& router, ostream& results, size_t& errors) {
+	if (pending.empty()) {
+		return;
+	}
+	vector<string> messages;
+	for (const PendingChange& change : pending) {
+		messages.push_back(change.serverMessage);
+	}
+	string response;
+	vector<char> committed;
+	router.sendBatch(messages, response, committed);
+	bool ok = find(committed.begin(), committed.end(), false) == committed.end();
+	results << "SYNC\t" << pending.size() << "\t" << (ok ? "OK" : "FAILED") << '\n';
+	for (size_t i = 0; i < pending.size(); i++) {
+		if (!committed[i]) {
+			results << "ERROR\t" << pending[i].lineNumber << "\tREJECTED BY SERVER\n";
+			errors++;
+		}
+	}
+	for (size_t i = pending.size(); i-- > 0;) {
+		if (!committed[i]) {
+			library.undoChange(pending[i].undoStep, librarian);
+		}
+	}
+	for (size_t i = 0; i < pending.size(); i++) {
+		if (committed[i]) {
+			library.keepChange(pending[i].undoStep);
+		}
+	}
+	pending.clear();
+}
+
+// This function runs the client without menus, reading one command per line from a script file or standard input.
+// Fields are separated by tabs so titles and authors can contain spaces and commas. Blank lines and lines starting with '#' are skipped.
+//   search title<TAB>title          search author<TAB>author
+//   add physical<TAB>title<TAB>author<TAB>shelf number
+//   add online<TAB>title<TAB>author<TAB>url
+//   delete<TAB>title
+//   rename title<TAB>old title<TAB>new title
+//   rename author<TAB>old author<TAB>new author
+//   list    list<TAB>title|author|shelf (sorted, the shelf order only has physical books)
+//   list server    sync    stats
+// Every command writes one "OK" or "ERROR" line with its line number, so the output can be read by another program.
+// For a change, "OK" means it was made in the library. If the server then rejects it, an "ERROR" line with the same line number follows the "SYNC" line and the change is undone.
+// Searches and lists write a "BOOK" line per book before their "OK" line, and 'stats' writes a "STAT" line per statistic.
+// Changes are made to the library straight away, but are only sent to the servers in batches of 'syncEvery' changes (or before 'list server', 'sync' and the end of the script).
+// Returns the number of commands that failed.
+size_t runScript(istream& script, ostream& results, Library& library, Librarian& librarian, ShardRouter& router) {
+	const size_t syncEvery = 1000;
+	vector<PendingChange> pending;
+	string line, serverMessage;
+	Library::UndoStep undoStep;
+	size_t lineNumber = 0, commands = 0, errors = 0;
+
+	while (getline(script, line)) {
+		lineNumber++;
+		if (!line.empty() && line.back() == '\r') {
+			line.pop_back(); // Scripts written on Windows end each line with "\r\n"
+		}
+		if (line.empty() || line[0] == '#') {
+			continue;
+		}
+		commands++;
+		vector<string> fields = splitFields(line);
+		const string& command = fields[0];
+		string status = "INVALID";
+		BookMutation mutation = { ' ', ' ', "", "", "", "", 0 };
+
+		if ((command == "search title" || command == "search author") && fields.size() == 2) {
+			vector<const Book*> found = command == "search title" ? library.findBooks(fields[1], "") : library.findBooks("", fields[1]);
+			for (const Book* book : found) {
+				results << "BOOK\t" << book->toRecord() << '\n';
+			}
+			results << "OK\t" << lineNumber << '\t' << found.size() << '\n';
+			continue;
+		}
+		else if (command == "list" && (fields.size() == 1 || (fields.size() == 2 && (fields[1] == "title" || fields[1] == "author" || fields[1] == "shelf")))) {
+			vector<const Book*> found;
+			if (fields.size() == 1) {
+				found = library.findBooks("", "");
+			}
+			else {
+				found = library.sortedBooks(fields[1] == "title" ? SortOrder::Title : fields[1] == "author" ? SortOrder::Author : SortOrder::Shelf);
+			}
+			for (const Book* book : found) {
+				results << "BOOK\t" << book->toRecord() << '\n';
+			}
+			results << "OK\t" << lineNumber << '\t' << found.size() << '\n';
+			continue;
+		}
+		else if (command == "list server" && fields.size() == 1) {
+			flushServerChanges(pending, library, librarian, router, results, errors);
+			vector<ServerBook> books = router.listAll();
+			for (const ServerBook& book : books) {
+				results << "BOOK\t" << book.type << '\t' << book.title << '\t' << book.author << '\n';
+			}
+			results << "OK\t" << lineNumber << '\t' << books.size() << '\n';
+			continue;
+		}
+		else if (command == "stats" && fields.size() == 1) {
+			const CatalogStats& stats = library.getStats();
+			results << "STAT\tbooks\t" << stats.total() << '\n';
+			results << "STAT\tphysical\t" << stats.countByType("PhysicalBook") << '\n';
+			results << "STAT\tonline\t" << stats.countByType("OnlineBook") << '\n';
+			for (const pair<string, size_t>& author : stats.topAuthors(10)) {
+				results << "STAT\tauthor\t" << author.first << '\t' << author.second << '\n';
+			}
+			for (const pair<const size_t, size_t>& range : stats.shelfOccupancy()) {
+				results << "STAT\tshelves\t" << range.first * CatalogStats::shelfRange << '-' << range.first * CatalogStats::shelfRange + CatalogStats::shelfRange - 1 << '\t' << range.second << '\n';
+			}
+			results << "OK\t" << lineNumber << '\n';
+			continue;
+		}
+		else if (command == "sync" && fields.size() == 1) {
+			flushServerChanges(pending, library, librarian, router, results, errors);
+			results << "OK\t" << lineNumber << '\n';
+			continue;
+		}
+		else if (command == "add physical" && fields.size() == 4) {
+			mutation = { '1', 'p', "", fields[1], fields[2], "", atoi(fields[3].c_str()) };
+		}
+		else if (command == "add online" && fields.size() == 4) {
+			mutation = { '1', 'o', "", fields[1], fields[2], fields[3], 0 };
+		}
+		else if (command == "delete" && fields.size() == 2) {
+			mutation = { '2', ' ', fields[1], "", "", "", 0 };
+		}
+		else if (command == "rename title" && fields.size() == 3) {
+			mutation = { '3', ' ', fields[1], fields[2], "", "", 0 };
+		}
+		else if (command == "rename author" && fields.size() == 3) {
+			mutation = { '4', ' ', fields[1], "", fields[2], "", 0 };
+		}
 
-		string result;
-		if (client.recieveMessage(result)) {
-			cout << "Server response: " << result << endl;
+		if (mutation.operation != ' ') {
+			status = library.applyMutation(mutation, librarian, serverMessage, undoStep);
+		}
+		if (status != "OK") {
+			results << "ERROR\t" << lineNumber << '\t' << status << '\n';
+			errors++;
+			continue;
+		}
+		results << "OK\t" << lineNumber << '\n';
+		pending.push_back({ lineNumber, serverMessage, undoStep });
+		if (pending.size() >= syncEvery) {
+			flushServerChanges(pending, library, librarian, router, results, errors);
 		}
 	}
+
+	flushServerChanges(pending, library, librarian, router, results, errors);
+	results << "DONE\t" << commands << '\t' << errors << '\n';
+	return errors;
+}
+
+// This function is for displaying the batch menu, where several changes are queued and then applied together.
+// The changes are applied to the library all or nothing, then sent to the server in one request.
+// A change the server doesn't commit (e.g. it rejected the batch) is undone in the library, so the library matches the server.
+void displayBatchMenu(Library& library, Librarian& librarian, ShardRouter& router) {
+	char batchChoice;
+	vector<BookMutation> batch;
+	vector<string> statuses, serverMessages;
+	vector<Library::UndoStep> undoSteps;
+	vector<char> committed;
+
+	do {
+		cout << "\n---Batch Menu--- (" << batch.size() << " changes queued)\n";
+		cout << "1: Queue New Book\n";
+		cout << "2: Queue Delete Book\n";
+		cout << "3: Queue Modify Book Title\n";
+		cout << "4: Queue Modify Book Author\n";
+		cout << "5: Apply Batch\n";
+		cout << "6: Cancel Batch\n";
+		cout << "Enter the number of your choice: ";
+		cin >> batchChoice;
+		cin.ignore();
+
+		BookMutation mutation = { batchChoice, ' ', "", "", "", "", 0 };
+
+		switch (batchChoice) {
+
+			// Queue New Book
+		case '1':
+			cout << "\nEnter book type, p for Physical or o for Online: ";
+			cin >> mutation.bookType;
+			cin.ignore();
+			if (mutation.bookType != 'p' && mutation.bookType != 'P' && mutation.bookType != 'o' && mutation.bookType != 'O') {
+				cout << "\nInvalid Input...";
+				break;
+			}
+			cout << "\nEnter book title: ";
+			getline(cin, mutation.title);
+			cout << "\nEnter book author: ";
+			getline(cin, mutation.author);
+			if (mutation.bookType == 'p' || mutation.bookType == 'P') {
+				cout << "\nEnter book shelf number: ";
+				cin >> mutation.shelfNum;
+			}
+			else {
+				cout << "\nEnter book url: ";
+				cin >> mutation.url;
+			}
+			batch.push_back(mutation);
+			break;
+
+			// Queue Delete Book
+		case '2':
+			cout << "\nEnter book title: ";
+			getline(cin, mutation.target);
+			batch.push_back(mutation);
+			break;
+
+			// Queue Modify Book Title
+		case '3':
+			cout << "\nEnter book title: ";
+			getline(cin, mutation.target);
+			cout << "\n Enter new title: ";
+			getline(cin, mutation.title);
+			batch.push_back(mutation);
+			break;
+
+			// Queue Modify Book Author
+		case '4':
+			cout << "\nEnter book author: ";
+			getline(cin, mutation.target);
+			cout << "\n Enter new author: ";
+			getline(cin, mutation.author);
+			batch.push_back(mutation);
+			break;
+
+			// Apply Batch
+		case '5':
+			if (batch.empty()) {
+				cout << "\nNo changes queued...\n";
+				break;
+			}
+			if (library.applyBatch(batch, librarian, statuses, serverMessages, undoSteps)) {
+				// All the changes are sent to the server in one request.
+				sendServerBatch(serverMessages, router, committed);
+				// The changes are undone newest first, so a change is undone before the ones it was made on top of, then the rest are kept.
+				for (size_t i = undoSteps.size(); i-- > 0;) {
+					if (!committed[i]) {
+						library.undoChange(undoSteps[i], librarian);
+						statuses[i] = "REJECTED BY SERVER";
+					}
+				}
+				for (size_t i = 0; i < undoSteps.size(); i++) {
+					if (committed[i]) {
+						library.keepChange(undoSteps[i]);
+					}
+				}
+				bool allCommitted = find(committed.begin(), committed.end(), false) == committed.end();
+				cout << (allCommitted ? "\nBatch applied to library...\n" : "\nThe server didn't commit every change, those changes were undone in the library...\n");
+			}
+			else {
+				cout << "\nBatch failed, no changes were made...\n";
+			}
+			for (size_t i = 0; i < statuses.size(); i++) {
+				cout << " " << i + 1 << ": " << statuses[i] << endl;
+			}
+			break;
+
+			// Cancel Batch
+		case 'q':
+		case '6':
+			cout << "\nExiting Batch Menu..." << endl;
+			break;
+		default:
+			cout << "\nInvalid choice. Please try again.\n";
+
+		}
+	} while (batchChoice != 'q' && batchChoice != '5' && batchChoice != '6'); // Loops until the batch is applied or cancelled.
 }
+
 // This function is for displaying the admin menu to add, remove and alter information about the books.
-void displayAdminMenu(Library& library, Librarian& librarian, ClientSocket& client) { // pass by reference not value so it can be altered and not cause memory allocation that can't be accessed.
+void displayAdminMenu(Library& library, Librarian& librarian, ShardRouter& router) { // pass by reference not value so it can be altered and not cause memory allocation that can't be accessed.
 	char adminChoice, bookType;
 	string title, author, url, userInput;
-	int shelfNum;
+	int shelfNum, port;
 
 	const Book* book = nullptr;
 
@@ -413,7 +2227,11 @@ void displayAdminMenu(Library& library, Librarian& librarian, ClientSocket& clie
 		cout << "2: Delete Book\n";
 		cout << "3: Modify Book Title\n";
 		cout << "4: Modify Book Author\n";
-		cout << "5: Return to Main Menu\n";
+		cout << "5: Batch Changes\n";
+		cout << "6: Add Server\n";
+		cout << "7: Save Server Snapshots\n";
+		cout << "8: Memory Usage\n";
+		cout << "9: Return to Main Menu\n";
 		cout << "Enter the number of your choice: ";
 		cin >> adminChoice;
 		cin.ignore();
@@ -439,20 +2257,26 @@ void displayAdminMenu(Library& library, Librarian& librarian, ClientSocket& clie
 				if (bookType == 'p' || bookType == 'P') {
 					cout << "\nEnter book shelf number: ";
 					cin >> shelfNum;
-					// The book is then added to the library.
-					library.addBook(new PhysicalBook(title, author, shelfNum));
+					// The book is then added to the library. Its memory is counted as part of the catalog.
+					{
+						MemoryScope scope(MemoryTag::Catalog);
+						library.addBook(new PhysicalBook(title, author, shelfNum));
+					}
 					// A message is sent to the server to simulate updating its database with the books title and author.
-					sendServerMessage("New Physical Book added to library titled: " + title + ", author: " + author, client);
+					sendServerMessage("New Physical Book added to library titled: " + title + ", author: " + author, router);
 					// The latest book is then displayed (This will be the book just added as it is appended to the end of the library)
 					library.showNewestBook();
 				}
 				else {
 					cout << "\nEnter book url: ";
 					cin >> url;
-					// The book is then added to the library.
-					library.addBook(new OnlineBook(title, author, url));
+					// The book is then added to the library. Its memory is counted as part of the catalog.
+					{
+						MemoryScope scope(MemoryTag::Catalog);
+						library.addBook(new OnlineBook(title, author, url));
+					}
 					// A message is sent to the server to simulate updating its database with the books title and author.
-					sendServerMessage("New Online Book added to library titled: " + title + ", author: " + author, client);
+					sendServerMessage("New Online Book added to library titled: " + title + ", author: " + author, router);
 					// The latest book is then displayed (This will be the book just added as it is appended to the end of the library)
 					library.showNewestBook();
 				}
@@ -479,7 +2303,7 @@ void displayAdminMenu(Library& library, Librarian& librarian, ClientSocket& clie
 					// Delete book if found
 					library.deleteBook(book);
 					// A message is sent to the server to simulate updating its database with the books title and author of the book deleted.
-					sendServerMessage("Deleted book from library titled: " + bookTitle + ", author: " + bookAuthor, client);
+					sendServerMessage("Deleted book from library titled: " + bookTitle + ", author: " + bookAuthor, router);
 				}
 				else {
 					cout << "\nBook deletion canceled..." << endl;
@@ -505,10 +2329,10 @@ void displayAdminMenu(Library& library, Librarian& librarian, ClientSocket& clie
 				// Set the currentTitle of the book so it can be used to simulate updating the server database.
 				const string currentTitle = book->getTitle();
 				// The book title is then changed with this method.
-				librarian.modifiyBookTitle(*book, title);
+				library.changeBookTitle(librarian, *book, title);
 				cout << "\n Book updated to title: " << title << endl;
 				// A message is sent to the server to simulate updating its database with the old book title and the new book title.
-				sendServerMessage("Book title updated in library from: " + currentTitle + ", to: " + title, client);
+				sendServerMessage("Book title updated in library from: " + currentTitle + ", to: " + title, router);
 			} 
 			else {
 				cout << "\nBook with title " << title << " not found" << endl;
@@ -528,10 +2352,10 @@ void displayAdminMenu(Library& library, Librarian& librarian, ClientSocket& clie
 				// Set the currentAuthor of the book so it can be used to simulate updating the server database.
 				const string currentAuthor = book->getAuthor();
 				// The book author is then changed with this method.
-				librarian.modifiyBookAuthor(*book, author);
+				library.changeBookAuthor(librarian, *book, author);
 				cout << "\n Book updated to author: " << author << endl;
 				// A message is sent to the server to simulate updating its database with the old book author and the new book author.
-				sendServerMessage("Book author updated in library from: " + currentAuthor + ", to: " + author, client);
+				sendServerMessage("Book author updated in library from: " + currentAuthor + ", to: " + author + ", title: " + book->getTitle(), router);
 			}
 			else {
 				cout << "\nBook with author " << author << " not found" << endl;
@@ -539,21 +2363,84 @@ void displayAdminMenu(Library& library, Librarian& librarian, ClientSocket& clie
 
 			break;
 
+			// Batch Changes
+		case '5':
+			displayBatchMenu(library, librarian, router);
+			break;
+
+			// Add Server
+		case '6':
+			// The catalog is split across the servers, so a new server takes over some of the books from the others.
+			cout << "\nEnter server port: ";
+			cin >> port;
+			if (router.addShard(port, true)) {
+				size_t moved = router.rebalance();
+				cout << "\nServer added, moved " << moved << " books to their new servers...\n";
+			}
+			else {
+				cout << "\nFailed to connect to server...\n";
+			}
+			break;
+
+			// Save Server Snapshots
+		case '7':
+			// Each server saves its catalog to a compressed file which it loads the next time it starts.
+			{
+				size_t saved = router.saveSnapshots();
+				cout << "\nSaved snapshots on " << saved << " of " << router.shardCount() << " servers...\n";
+			}
+			break;
+
+			// Memory Usage
+		case '8':
+			// Shows how much memory the client and each server are using for the catalog, indexes, networking and logging.
+			{
+				string stats = "Client:\n" + MemoryTracker::report() + MemoryTracker::heapSnapshot() + router.memoryStats();
+				cout << "\n" << stats;
+			}
+			break;
+
 			// Exit Admin Menu
 		case 'q':
-		case '5':
+		case '9':
 			cout << "\nExiting Admin Menu..." << endl;
 			break;
 		default:
 			cout << "\nInvalid choice. Please try again.\n";
 
 		}
-	} while (adminChoice != 'q' && adminChoice != '5'); // Loops through the admin menu until the user quits using 'q' or '5' as an input.
+	} while (adminChoice != 'q' && adminChoice != '9'); // Loops through the admin menu until the user quits using 'q' or '9' as an input.
 }
 
 // Main Program
 int main(int argc, char* argv[]) {
 	try {
+		// "benchmark [books]" compares the virtual 'Book' classes with the variant records on a synthetic catalog (1 million books by default).
+		if (argc >= 2 && string(argv[1]) == "benchmark") {
+			benchmarkBackends(argc >= 3 ? strtoull(argv[2], NULL, 10) : 1000000);
+			return 0;
+		}
+
+		// "script <file>" runs the commands in the file without any menus, "script -" reads them from standard input.
+		// In script mode only the results are written out. Everything else the program prints is turned off by putting 'cout' into a failed state,
+		// and the results are written through a separate stream that shares the console.
+		int firstPort = 1;
+		string scriptPath;
+		ostream results(cout.rdbuf());
+		ifstream scriptFile;
+		if (argc > 2 && string(argv[1]) == "script") {
+			scriptPath = argv[2];
+			firstPort = 3;
+			if (scriptPath != "-") {
+				scriptFile.open(scriptPath);
+				if (!scriptFile) {
+					results << "ERROR\t0\tCANNOT OPEN SCRIPT" << endl;
+					return 1;
+				}
+			}
+			cout.setstate(ios::failbit);
+		}
+
 		// Functional Pointer
 		void (*startFunction)() = startMessage;
 		startFunction();
@@ -562,59 +2449,91 @@ int main(int argc, char* argv[]) {
 		Library library;
 
 		// Adding books manually on startup
-		library.addBook(new PhysicalBook("The Silent Echo", "Emma Blackwood", 82));
-		library.addBook(new PhysicalBook("Whispers in the Dark", "Liam Hunter", 150));
-		library.addBook(new PhysicalBook("The Last Embrace", "Dylan Cooper", 199));
-		library.addBook(new PhysicalBook("The Forgotten Path", "James Whitmore", 177));
-		library.addBook(new PhysicalBook("Shadows of the Lost", "Grace Bennett", 43));
-		library.addBook(new PhysicalBook("The Hidden Garden", "Ava Montgomery", 37));
-		library.addBook(new PhysicalBook("Fragments of the Past", "Nora Stevens", 163));
-		library.addBook(new PhysicalBook("The Burning Sky", "Oliver Gray", 185));
-		library.addBook(new PhysicalBook("Dance of the Stars", "Harper Wilson", 135));
-		library.addBook(new PhysicalBook("Shattered Glass", "Sebastian Cole", 180));
-		library.addBook(new PhysicalBook("Between Worlds", "Jasper Ford", 211));
-		library.addBook(new PhysicalBook("The Heart of the Storm", "Mason White", 129));
-		library.addBook(new PhysicalBook("A Symphony of Souls", "Leo Knight", 53));
-
-		library.addBook(new OnlineBook("The Shadow's Edge", "Clara Mills", "www.myOnlineBook/index/ApbD7fI2"));
-		library.addBook(new OnlineBook("The Forgotten Kingdom", "Henry Wright", "www.myOnlineBook/index/W7kRm9Dg"));
-		library.addBook(new OnlineBook("The Depths of Desire", "Lena Murphy", "www.myOnlineBook/index/X4nB2qJk"));
-		library.addBook(new OnlineBook("The Silent Witness", "David Reed", "www.myOnlineBook/index/F3nGp0Ls"));
-		library.addBook(new OnlineBook("Requiem for the Lost", "Natalie Stone", "www.myOnlineBook/index/P1cQxR8I"));
-		library.addBook(new OnlineBook("Journey into the Unknown", "Isobel Price", "www.myOnlineBook/index/Uj4Cz1T9"));
-		library.addBook(new OnlineBook("A World of Dreams", "Mason Hart", "www.myOnlineBook/index/L1zX9fT6"));
-		library.addBook(new OnlineBook("The Edge of Tomorrow", "Ethan Matthews", "www.myOnlineBook/index/M0yJq2F7"));
-		library.addBook(new OnlineBook("Whispers in the Wind", "Benjamin Miles", "www.myOnlineBook/index/Z0mV9p4J"));
+		// The books are counted as catalog memory.
+		{
+			MemoryScope scope(MemoryTag::Catalog);
+			library.addBook(new PhysicalBook("The Silent Echo", "Emma Blackwood", 82));
+			library.addBook(new PhysicalBook("Whispers in the Dark", "Liam Hunter", 150));
+			library.addBook(new PhysicalBook("The Last Embrace", "Dylan Cooper", 199));
+			library.addBook(new PhysicalBook("The Forgotten Path", "James Whitmore", 177));
+			library.addBook(new PhysicalBook("Shadows of the Lost", "Grace Bennett", 43));
+			library.addBook(new PhysicalBook("The Hidden Garden", "Ava Montgomery", 37));
+			library.addBook(new PhysicalBook("Fragments of the Past", "Nora Stevens", 163));
+			library.addBook(new PhysicalBook("The Burning Sky", "Oliver Gray", 185));
+			library.addBook(new PhysicalBook("Dance of the Stars", "Harper Wilson", 135));
+			library.addBook(new PhysicalBook("Shattered Glass", "Sebastian Cole", 180));
+			library.addBook(new PhysicalBook("Between Worlds", "Jasper Ford", 211));
+			library.addBook(new PhysicalBook("The Heart of the Storm", "Mason White", 129));
+			library.addBook(new PhysicalBook("A Symphony of Souls", "Leo Knight", 53));
+
+			library.addBook(new OnlineBook("The Shadow's Edge", "Clara Mills", "www.myOnlineBook/index/ApbD7fI2"));
+			library.addBook(new OnlineBook("The Forgotten Kingdom", "Henry Wright", "www.myOnlineBook/index/W7kRm9Dg"));
+			library.addBook(new OnlineBook("The Depths of Desire", "Lena Murphy", "www.myOnlineBook/index/X4nB2qJk"));
+			library.addBook(new OnlineBook("The Silent Witness", "David Reed", "www.myOnlineBook/index/F3nGp0Ls"));
+			library.addBook(new OnlineBook("Requiem for the Lost", "Natalie Stone", "www.myOnlineBook/index/P1cQxR8I"));
+			library.addBook(new OnlineBook("Journey into the Unknown", "Isobel Price", "www.myOnlineBook/index/Uj4Cz1T9"));
+			library.addBook(new OnlineBook("A World of Dreams", "Mason Hart", "www.myOnlineBook/index/L1zX9fT6"));
+			library.addBook(new OnlineBook("The Edge of Tomorrow", "Ethan Matthews", "www.myOnlineBook/index/M0yJq2F7"));
+			library.addBook(new OnlineBook("Whispers in the Wind", "Benjamin Miles", "www.myOnlineBook/index/Z0mV9p4J"));
+		}
 
 		// Instantiate class object
 		Librarian librarian;
 
 		// LOGGING (Testing)
 		Logger logger;
-		logger.logMessage(Book::getTotalBooks()); // Log the total number of books currently in the library
+		logger.logMessage((int)library.getStats().total()); // Log the total number of books currently in the library
 
 		const char* serverIp = "127.0.0.1"; // Set IP (local)
-		int port = 55555;					// Set port (local)
+		vector<int> ports = { 55555 };		// Set port (local)
+
+		// The catalog can be split across several servers by passing each server's port on the command line.
+		// The socket options can be changed too: "nodelay off" lets small messages be joined together, "sndbuf <KB>" and "rcvbuf <KB>" set the socket buffer sizes.
+		SocketOptions socketOptions;
+		vector<int> commandLinePorts;
+		for (int i = firstPort; i < argc; i++) {
+			string arg = argv[i];
+			if (arg == "nodelay" && i + 1 < argc) {
+				socketOptions.noDelay = string(argv[++i]) != "off";
+			}
+			else if (arg == "sndbuf" && i + 1 < argc) {
+				socketOptions.sendBufferSize = atoi(argv[++i]) * 1024;
+			}
+			else if (arg == "rcvbuf" && i + 1 < argc) {
+				socketOptions.recieveBufferSize = atoi(argv[++i]) * 1024;
+			}
+			else {
+				commandLinePorts.push_back(atoi(argv[i]));
+			}
+		}
+		if (!commandLinePorts.empty()) {
+			ports = commandLinePorts;
+		}
+
 
 		// Instantiate class object
-		ClientSocket client(port, serverIp); 
+		ShardRouter router(serverIp, socketOptions);
 
-		// These methods start a client connection to the server.
-		// This method finds the Winsock dll.
-		if (!client.initaliseWinsock()) {
-			logger.logMessage("\nFailure to initialise winsock client...");
+		// This method starts a client connection to each server, connecting to all of them at once.
+		// It finds the Winsock dll, creates a client socket and connects to the server.
+		if (!router.addShards(ports)) {
+			logger.logMessage("\nFailure to connect to server");
+			if (!scriptPath.empty()) {
+				results << "ERROR\t0\tCANNOT CONNECT" << endl;
+				return 1;
+			}
 			return 0;
 		}
-		// This method creates a client socket.
-		if (!client.createSocket()) {
-			logger.logMessage("\nFailure to create socket...");
-			return 0;
+
+		// Every server starts with the same books, so the books each server doesn't own are moved or removed.
+		if (router.shardCount() > 1) {
+			logger.logMessage("Moved " + to_string(router.rebalance()) + " books to their servers");
 		}
 
-		// This method connects to the server.
-		if (!client.connectToServer()) {
-			logger.logMessage("\nFailure to connect to server");
-			return 0;
+		if (!scriptPath.empty()) {
+			size_t errors = (scriptPath == "-") ? runScript(cin, results, library, librarian, router) : runScript(scriptFile, results, library, librarian, router);
+			results.flush();
+			return errors == 0 ? 0 : 1;
 		}
 
 		char choice;
@@ -627,11 +2546,12 @@ int main(int argc, char* argv[]) {
 			cout << "1: View All Books\n";
 			cout << "2: View Physical Books\n";
 			cout << "3: View Online Books\n";
-			cout << "4: Total Number of Books\n";
+			cout << "4: Library Statistics\n";
 			cout << "5: Search for book by title\n";
 			cout << "6: Search for book by author\n";
 			cout << "7: Admin Menu\n";
-			cout << "8: Quit\n";
+			cout << "8: View Server Catalog\n";
+			cout << "9: Quit\n";
 			cout << "Enter the number of your choice: ";
 			cin >> choice;
 
@@ -644,7 +2564,21 @@ int main(int argc, char* argv[]) {
 
 				// View all books
 			case '1':
-				library.showAllBooks(); // Calls the 'showAllBooks()' method which displays all books.
+				// The books can be listed sorted by title, author or shelf, otherwise they are listed in the order they were added.
+				cout << "Sort by t for title, a for author, s for shelf, or press enter for the order they were added: ";
+				getline(cin, userInput);
+				if (userInput == "t" || userInput == "T") {
+					library.showSortedBooks(SortOrder::Title);
+				}
+				else if (userInput == "a" || userInput == "A") {
+					library.showSortedBooks(SortOrder::Author);
+				}
+				else if (userInput == "s" || userInput == "S") {
+					library.showSortedBooks(SortOrder::Shelf);
+				}
+				else {
+					library.showAllBooks(); // Calls the 'showAllBooks()' method which displays all books.
+				}
 				break;
 				// View all Physical books
 			case '2': 
@@ -654,9 +2588,11 @@ int main(int argc, char* argv[]) {
 			case '3':
 				library.showBookByType("OnlineBook"); // Displays all books with type 'OnlineBook'
 				break;
-				// Display total number of books
+				// Display library statistics
 			case '4':
-				cout << "\nTotal number of books: " << Book::getTotalBooks() << endl; // Displays total number of books using 'getTotalBooks()' method.
+				// Displays the total number of books, followed by the counts by type, the authors with the most books and how full the shelves are.
+				// These are kept up to date by the library so they don't need to go through the books.
+				cout << library.getStats().report(5);
 				break;
 				// Search for a book by title
 			case '5':
@@ -684,20 +2620,25 @@ int main(int argc, char* argv[]) {
 				break;
 				// Display the admin menu
 			case '7':
-				displayAdminMenu(library, librarian, client);
+				displayAdminMenu(library, librarian, router);
+				break;
+				// Display the books held by the servers
+			case '8':
+				// Every server is asked for its books at the same time and the results are merged by title.
+				for (const ServerBook& book : router.listAll()) {
+					cout << book.type << " Book - Title: " << book.title << ", Author: " << book.author << endl;
+				}
 				break;
 				// Exit application
 			case 'q':
-			case '8':
+			case '9':
 				cout << "Exiting Program" << endl;
 				break;
 			default:
 				cout << "Invalid choice. Please try again.\n";
 			}
 
-		} while (choice != 'q' && choice != '8'); // Loops through the main menu until the user quits using 'q' or '8' as an input.
-
-		client.cleanUp(); // Deallocating memory 
+		} while (choice != 'q' && choice != '9'); // Loops through the main menu until the user quits using 'q' or '9' as an input.
 
 	}
 	// Catch custom library exception